@@ -0,0 +1,200 @@
+#pragma once
+
+#include "Bodies.h"
+#include "ForceKernels.h"
+#include "ThreadPool.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <vector>
+
+/*
+	Accuracy harness: tree forces against O(N^2) direct summation.
+
+	Summing every body directly would cost far more than the pass being checked, so
+	exact accelerations are only computed for a fixed random sample of S bodies, at
+	O(N*S). Sources are cut into DIRECT_BLOCK body blocks that stay in cache while a tile
+	of DIRECT_TILE sampled targets runs through each, and tiles are spread over the pool.
+	Errors are relative to each sampled body's exact acceleration.
+
+	Energy and momentum are tracked too. Kinetic energy and momentum are summed over
+	every body; the potential is summed exactly for the sampled bodies and scaled up to
+	all N, which is exact once S is N. Drift is taken against the invariants recorded by
+	begin().
+*/
+struct AccuracyReport {
+	size_t samples;
+	double rms_error; //! Root mean square relative acceleration error over the samples
+	double max_error; //! Largest relative acceleration error over the samples
+};
+
+struct Invariants {
+	double kinetic;
+	double potential;
+	Vec4 momentum;
+	double momentum_scale; //! Sum of |m v|, what a momentum error is measured against
+
+	double energy() const
+	{
+		return kinetic + potential;
+	}
+};
+
+const constexpr size_t DIRECT_BLOCK = 4096; //! Sources kept in cache by the direct sum
+const constexpr size_t DIRECT_TILE = 16; //! Sampled targets run against each source block
+
+// Exact acceleration of points[indices[k]] into res[k], summed over every body in sources
+inline void DirectAccelerations(const Bodies& sources, const std::vector<Vec4>& points, const std::vector<uint32_t>& indices,
+	double G, ForceKernel kernel, ThreadPool& pool, std::vector<Vec4>& res)
+{
+	res.assign(indices.size(), Vec4(0.0, 0.0, 0.0, 0.0));
+	pool.parallelFor(0, indices.size(), DIRECT_TILE, [&](size_t begin, size_t end, size_t)
+	{
+		for (size_t first = 0; first < sources.size(); first += DIRECT_BLOCK)
+		{
+			const size_t n = std::min(DIRECT_BLOCK, sources.size() - first);
+			for (size_t k = begin; k < end; k++)
+			{
+				// A unit mass target makes the kernel return acceleration rather than force
+				const Vec4& p = points[indices[k]];
+				kernel(Vec4(p.x, p.y, p.z, 1.0), sources.x.data() + first, sources.y.data() + first, sources.z.data() + first,
+					sources.m.data() + first, n, G, res[k]);
+			}
+		}
+	});
+}
+
+class AccuracyHarness {
+	std::vector<uint32_t> indices;
+	std::vector<Vec4> reference;
+	std::vector<double> potentials;
+	Bodies sources;
+	Invariants initial;
+
+public:
+	static const constexpr size_t SAMPLES = 1000; //! Default bodies summed directly
+
+	// Samples up to samples of n bodies, the same ones for every later measurement
+	AccuracyHarness(size_t n, size_t samples = SAMPLES, uint64_t seed = 0)
+		: initial{ 0.0, 0.0, Vec4(0.0, 0.0, 0.0, 0.0), 0.0 }
+	{
+		std::vector<uint32_t> all(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			all[i] = uint32_t(i);
+		}
+
+		std::mt19937_64 rand(seed);
+		std::sample(all.begin(), all.end(), std::back_inserter(indices), std::min(samples, n), rand);
+	}
+
+	const std::vector<uint32_t>& getSamples() const
+	{
+		return indices;
+	}
+
+	// Error of accelerations against direct summation over positions (w holds the mass)
+	AccuracyReport measureForces(const std::vector<Vec4>& positions, const std::vector<Vec4>& accelerations, double G,
+		ForceKernel kernel, ThreadPool& pool)
+	{
+		sources = Bodies::fromPoints(positions);
+		DirectAccelerations(sources, positions, indices, G, kernel, pool, reference);
+
+		double sum = 0.0;
+		double max = 0.0;
+		size_t counted = 0;
+		for (size_t k = 0; k < indices.size(); k++)
+		{
+			const double norm_sqr = reference[k].normSquared();
+			if (norm_sqr == 0.0)
+			{
+				continue;
+			}
+			const double error_sqr = (accelerations[indices[k]] - reference[k]).normSquared() / norm_sqr;
+			sum += error_sqr;
+			max = std::max(max, std::sqrt(error_sqr));
+			counted++;
+		}
+
+		return { counted, counted == 0 ? 0.0 : std::sqrt(sum / double(counted)), max };
+	}
+
+	Invariants measureInvariants(const std::vector<Vec4>& positions, const std::vector<Vec4>& velocities, double G,
+		ThreadPool& pool)
+	{
+		Invariants res{ 0.0, 0.0, Vec4(0.0, 0.0, 0.0, 0.0), 0.0 };
+		for (size_t i = 0; i < positions.size(); i++)
+		{
+			const double m = positions[i].w;
+			const Vec4& v = velocities[i];
+			const double v_sqr = v.x * v.x + v.y * v.y + v.z * v.z;
+			res.kinetic += 0.5 * m * v_sqr;
+			res.momentum += m * Vec4(v.x, v.y, v.z, 0.0);
+			res.momentum_scale += m * std::sqrt(v_sqr);
+		}
+
+		// Potential of each sampled body against every other body
+		potentials.assign(indices.size(), 0.0);
+		pool.parallelFor(0, indices.size(), DIRECT_TILE, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				const Vec4& p = positions[indices[k]];
+				double phi = 0.0;
+				for (const auto& q : positions)
+				{
+					const double dx = q.x - p.x;
+					const double dy = q.y - p.y;
+					const double dz = q.z - p.z;
+					const double r2 = dx * dx + dy * dy + dz * dz;
+					if (r2 != 0.0)
+					{
+						phi -= q.w / std::sqrt(r2);
+					}
+				}
+				potentials[k] = G * p.w * phi;
+			}
+		});
+
+		// Each pair appears in both bodies' potentials
+		double sum = 0.0;
+		for (double u : potentials)
+		{
+			sum += u;
+		}
+		if (!indices.empty())
+		{
+			res.potential = 0.5 * sum * double(positions.size()) / double(indices.size());
+		}
+		return res;
+	}
+
+	// Records the invariants later drift is measured against
+	void begin(const std::vector<Vec4>& positions, const std::vector<Vec4>& velocities, double G, ThreadPool& pool)
+	{
+		initial = measureInvariants(positions, velocities, G, pool);
+	}
+
+	const Invariants& getInitial() const
+	{
+		return initial;
+	}
+
+	// Relative change in total energy since begin()
+	double energyDrift(const Invariants& now) const
+	{
+		const double e0 = initial.energy();
+		return e0 == 0.0 ? 0.0 : std::abs(now.energy() - e0) / std::abs(e0);
+	}
+
+	// Change in total momentum since begin(), relative to the bodies' summed |m v|
+	double momentumDrift(const Invariants& now) const
+	{
+		const double scale = std::max(initial.momentum_scale, now.momentum_scale);
+		return scale == 0.0 ? 0.0 : (now.momentum - initial.momentum).norm() / scale;
+	}
+};
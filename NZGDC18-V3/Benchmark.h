@@ -0,0 +1,695 @@
+#pragma once
+
+#include "Accuracy.h"
+#include "BodyOrder.h"
+#include "ForceKernels.h"
+#include "InitialConditions.h"
+#include "PerfCounters.h"
+#include "Snapshot.h"
+#include "Trajectory.h"
+#include "TraversalStats.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+	Command line benchmark driver configuration and reporting.
+
+	Every option taking a list sweeps it, and each combination of body count, thread
+	count, engine and opening parameter is one case. A case generates its initial
+	conditions on its own threads (the same bodies for any thread count, see
+	InitialConditions.h), then takes warmup untimed steps and steps timed steps, timing
+	the tree build, the force pass and the leapfrog integration of each step separately.
+	Results are written one row (CSV) or object (JSON) per case, with the mean and
+	percentiles of every phase over the timed steps rather than a single mean rate.
+
+	The engines span every stage of the talk, from the V1 and V2 trees to the linear
+	octrees and the FMM, so each optimisation can be A/B tested on one machine in one run.
+	All of them share ForcePass and the selected kernel, so the difference is the tree.
+
+	With --counters each phase also reads the hardware counters of PerfCounters.h, and a
+	traversal phase is added: the same pass again with ForceBatchNone, outside the step
+	time, so the walk's share of the force phase can be told apart from the kernel's.
+
+	Every case also reports its walk counts from TraversalStats.h over the timed steps:
+	nodes visited, clusters accepted and leaf interactions per walk, the deepest traversal
+	stack and the deepest leaf, with the full leaf depth histogram in JSON.
+
+	--write-snapshot saves the generated bodies of the largest case and exits, and
+	--snapshot starts every case from the first bodies of such a file instead of the
+	generator, see Snapshot.h. The generate time is then the time to load them.
+
+	--trajectory writes the positions every --trajectory-every steps through the
+	TrajectoryWriter of Trajectory.h. Handing a frame over is timed as the output phase,
+	and is part of the step, so its percentiles bound the jitter writing adds. The quantised
+	codec keeps positions within --trajectory-error. With --accuracy the file is read back
+	after the case and every frame compared with what was handed over, so the error
+	reported is the one measured.
+
+	--order permutes the bodies along a Morton or Hilbert curve after every build, see
+	BodyOrder.h, and the time it takes counts as build time. Only the engines on a linear
+	octree reorder, the others keep input order and report it.
+
+	--mixed runs the tree walks through the mixed precision kernels. The FMM only has
+	double precision kernels and keeps them. --accuracy checks the accelerations of the
+	last step against direct summation with the scalar double kernel, on the sample of
+	Accuracy.h, after the timed steps, and --error-budget fails the run when any case's
+	RMS error is above it.
+*/
+enum class Engine {
+	V1,      //! The NZGDC18-V1 recursive tree, see LegacyOctree.h
+	V2,      //! The NZGDC18-V2 explicit list tree, queried from one worker
+	Pointer, //! brandonpelfrey::Octree, one insert at a time
+	Linear,  //! LinearOctree, built serially from Morton sorted bodies
+	Karras,  //! LinearOctree, built in parallel from a binary radix tree
+	Fmm,     //! Parallel LinearOctree with the dual-tree FMM instead of a tree walk
+};
+
+enum class CriterionType {
+	Radius,
+	BarnesHut,
+	SalmonWarren,
+};
+
+inline const char* EngineName(Engine engine)
+{
+	switch (engine)
+	{
+	case Engine::V1: return "v1";
+	case Engine::V2: return "v2";
+	case Engine::Pointer: return "pointer";
+	case Engine::Linear: return "linear";
+	case Engine::Karras: return "karras";
+	case Engine::Fmm: return "fmm";
+	}
+	return "unknown";
+}
+
+inline const char* CriterionTypeName(CriterionType criterion)
+{
+	switch (criterion)
+	{
+	case CriterionType::Radius: return "radius";
+	case CriterionType::BarnesHut: return "barnes-hut";
+	case CriterionType::SalmonWarren: return "salmon-warren";
+	}
+	return "unknown";
+}
+
+inline const char* SimdIsaOption(SimdIsa isa)
+{
+	switch (isa)
+	{
+	case SimdIsa::AVX2: return "avx2";
+	case SimdIsa::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+enum class OutputFormat {
+	Csv,
+	Json,
+};
+
+struct BenchmarkConfig {
+	std::vector<size_t> bodies = { 100000 };
+	std::vector<size_t> threads = { 0 };         //! 0 uses every hardware thread
+	std::vector<Engine> engines = { Engine::Karras };
+	std::vector<double> openings = { 0.5 };      //! Theta, or the radius for the radius criterion
+	CriterionType criterion = CriterionType::BarnesHut;
+	InitialConditions generator = InitialConditions::Uniform;
+	uint64_t seed = DEFAULT_SEED;
+	size_t steps = 10;
+	size_t warmup = 1;
+	double dt = 1.0 / 60.0;
+	double G = 6.67408e-11;
+	SimdIsa isa = SimdIsa::AVX512;               //! Clamped to the host at runtime
+	bool quadrupoles = false;
+	bool counters = false;                       //! Read hardware counters per phase
+	uint32_t group_size = 64;
+	OutputFormat format = OutputFormat::Csv;
+	std::string snapshot;                        //! Initial conditions to load instead of generating them
+	std::string write_snapshot;                  //! Write the generated initial conditions here and exit
+	SnapshotLayout snapshot_layout = SnapshotLayout::Packed;
+	std::string trajectory;                      //! Write positions here as the cases run, each case replacing it
+	size_t trajectory_every = 1;                 //! Steps between trajectory frames
+	FrameCodec trajectory_codec = FrameCodec::XorDelta;
+	double trajectory_error = QUANTISED_ERROR;   //! Position error bound of the quantised codec
+	BodyOrder body_order = BodyOrder::Input;
+	bool mixed = false;                          //! Walk with the mixed precision kernels
+	bool accuracy = false;                       //! Measure each case's forces against direct summation
+	double error_budget = 0.0;                   //! Largest RMS force error allowed, 0 for no budget
+};
+
+// Order the bodies of engine's cases are kept in
+inline BodyOrder CaseBodyOrder(const BenchmarkConfig& config, Engine engine)
+{
+	const bool linear = engine == Engine::Linear || engine == Engine::Karras || engine == Engine::Fmm;
+	return linear ? config.body_order : BodyOrder::Input;
+}
+
+// Whether engine's cases walk with the mixed precision kernels, which the FMM has none of
+inline bool CaseMixed(const BenchmarkConfig& config, Engine engine)
+{
+	return config.mixed && engine != Engine::Fmm;
+}
+
+// Name of where the initial conditions come from, as reported
+inline const char* InitialConditionsSource(const BenchmarkConfig& config)
+{
+	return config.snapshot.empty() ? InitialConditionsName(config.generator) : "snapshot";
+}
+
+struct BenchmarkCase {
+	size_t bodies;
+	size_t threads;
+	Engine engine;
+	double opening;
+};
+
+// Every combination of the swept options, engines varying fastest
+inline std::vector<BenchmarkCase> BenchmarkCases(const BenchmarkConfig& config)
+{
+	std::vector<BenchmarkCase> res;
+	for (size_t bodies : config.bodies)
+		for (size_t threads : config.threads)
+			for (double opening : config.openings)
+				for (Engine engine : config.engines)
+					res.push_back({ bodies, threads, engine, opening });
+	return res;
+}
+
+struct PhaseSummary {
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double min;
+	double max;
+};
+
+// Nearest-rank percentiles of samples
+inline PhaseSummary Summarise(std::vector<double> samples)
+{
+	if (samples.empty())
+	{
+		return { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+	}
+
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&](double p)
+	{
+		const size_t rank = size_t(p / 100.0 * double(samples.size()) + 0.999999);
+		return samples[std::min(samples.size(), std::max<size_t>(rank, 1)) - 1];
+	};
+
+	double sum = 0.0;
+	for (double s : samples)
+		sum += s;
+	return { sum / double(samples.size()), percentile(50.0), percentile(90.0), percentile(99.0), samples.front(), samples.back() };
+}
+
+struct BenchmarkResult {
+	BenchmarkCase config;
+	size_t threads;              //! Workers actually used
+	SimdIsa isa;                 //! Kernel actually used
+	double generate;             //! Seconds to generate the initial conditions
+	std::vector<double> build;   //! Seconds per timed step, likewise below
+	std::vector<double> force;
+	std::vector<double> integrate;
+	std::vector<double> output;  //! Handing frames to the trajectory writer, 0 without one
+	std::vector<double> step;
+	size_t interactions;         //! Interactions in the last timed step
+	InteractionStats stats;      //! Merged over every timed step, evaluated is their total
+	PerfSample perf[4];          //! Counters per PERF_PHASES entry over the timed steps
+	TrajectoryStats trajectory;
+	double trajectory_error;     //! Largest error reading the trajectory back, 0 without --accuracy
+	AccuracyReport accuracy;     //! Of the last step, all 0 without --accuracy
+};
+
+const constexpr char* PERF_PHASES[] = { "build", "traversal", "force", "integrate" };
+
+const constexpr char* BENCHMARK_PHASES[] = { "build", "force", "integrate", "output", "step" };
+
+inline const std::vector<double>& Phase(const BenchmarkResult& r, size_t phase)
+{
+	switch (phase)
+	{
+	case 0: return r.build;
+	case 1: return r.force;
+	case 2: return r.integrate;
+	case 3: return r.output;
+	default: return r.step;
+	}
+}
+
+inline void WriteBenchmarkCsv(const BenchmarkConfig& config, const std::vector<BenchmarkResult>& results, std::ostream& out)
+{
+	out << "engine,criterion,generator,isa,bodies,threads,opening,steps,interactions_per_body,generate_ms";
+	for (const char* phase : BENCHMARK_PHASES)
+	{
+		for (const char* stat : { "mean", "p50", "p90", "p99", "min", "max" })
+		{
+			out << "," << phase << "_" << stat << "_ms";
+		}
+	}
+	out << ",nodes_per_walk,clusters_per_walk,leaf_interactions_per_walk,max_stack_depth,max_tree_depth";
+	if (config.counters)
+	{
+		for (const char* phase : PERF_PHASES)
+		{
+			out << "," << phase << "_ipc";
+			for (size_t e = 0; e < PERF_EVENTS; e++)
+			{
+				out << "," << phase << "_" << PerfEventName(PerfEvent(e)) << "_per_interaction";
+			}
+		}
+	}
+	if (!config.trajectory.empty())
+	{
+		out << ",trajectory_frames,trajectory_dropped,trajectory_compression,trajectory_max_submit_ms,trajectory_max_error";
+		if (config.accuracy)
+			out << ",trajectory_measured_error";
+	}
+	if (config.body_order != BodyOrder::Input)
+	{
+		out << ",order";
+	}
+	if (config.mixed)
+	{
+		out << ",precision";
+	}
+	if (config.accuracy)
+	{
+		out << ",accuracy_samples,rms_error,max_error";
+	}
+	out << "\n";
+
+	for (const auto& r : results)
+	{
+		out << EngineName(r.config.engine) << "," << CriterionTypeName(config.criterion) << ","
+			<< InitialConditionsSource(config) << "," << SimdIsaOption(r.isa) << "," << r.config.bodies << ","
+			<< r.threads << "," << r.config.opening << "," << r.step.size() << ","
+			<< double(r.interactions) / double(r.config.bodies) << "," << r.generate * 1000.0;
+		for (size_t phase = 0; phase < 5; phase++)
+		{
+			const PhaseSummary s = Summarise(Phase(r, phase));
+			for (double v : { s.mean, s.p50, s.p90, s.p99, s.min, s.max })
+			{
+				out << "," << v * 1000.0;
+			}
+		}
+		const TraversalStats& t = r.stats.traversal;
+		const double walks = double(std::max<uint64_t>(t.walks, 1));
+		out << "," << double(t.nodes_visited) / walks << "," << double(t.clusters_accepted) / walks << ","
+			<< double(t.leaf_interactions) / walks << "," << t.max_stack_depth << "," << r.stats.leaf_depths.maxDepth();
+		if (config.counters)
+		{
+			// Counters the host doesn't offer are left empty
+			for (const auto& s : r.perf)
+			{
+				out << ",";
+				if (s.ipc() > 0.0)
+					out << s.ipc();
+				for (size_t e = 0; e < PERF_EVENTS; e++)
+				{
+					out << ",";
+					if (s.valid[e] && r.stats.evaluated > 0)
+						out << s.values[e] / double(r.stats.evaluated);
+				}
+			}
+		}
+		if (!config.trajectory.empty())
+		{
+			const TrajectoryStats& w = r.trajectory;
+			out << "," << w.frames << "," << w.dropped << "," << double(w.raw_bytes) / double(std::max<size_t>(w.file_bytes, 1))
+				<< "," << w.max_submit * 1000.0 << "," << w.max_error;
+			if (config.accuracy)
+				out << "," << r.trajectory_error;
+		}
+		if (config.body_order != BodyOrder::Input)
+		{
+			out << "," << BodyOrderName(CaseBodyOrder(config, r.config.engine));
+		}
+		if (config.mixed)
+		{
+			out << "," << (CaseMixed(config, r.config.engine) ? "mixed" : "double");
+		}
+		if (config.accuracy)
+		{
+			out << "," << r.accuracy.samples << "," << r.accuracy.rms_error << "," << r.accuracy.max_error;
+		}
+		out << "\n";
+	}
+	out.flush();
+}
+
+inline void WriteBenchmarkJson(const BenchmarkConfig& config, const std::vector<BenchmarkResult>& results, std::ostream& out)
+{
+	out << "[\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const auto& r = results[i];
+		out << "  {\"engine\": \"" << EngineName(r.config.engine) << "\", \"criterion\": \"" << CriterionTypeName(config.criterion)
+			<< "\", \"generator\": \"" << InitialConditionsSource(config) << "\", \"order\": \""
+			<< BodyOrderName(CaseBodyOrder(config, r.config.engine)) << "\", \"precision\": \""
+			<< (CaseMixed(config, r.config.engine) ? "mixed" : "double") << "\", \"isa\": \"" << SimdIsaOption(r.isa)
+			<< "\", \"bodies\": " << r.config.bodies << ", \"threads\": " << r.threads << ", \"opening\": " << r.config.opening
+			<< ", \"steps\": " << r.step.size() << ", \"interactions_per_body\": " << double(r.interactions) / double(r.config.bodies)
+			<< ", \"generate_ms\": " << r.generate * 1000.0;
+		for (size_t phase = 0; phase < 5; phase++)
+		{
+			const PhaseSummary s = Summarise(Phase(r, phase));
+			out << ", \"" << BENCHMARK_PHASES[phase] << "_ms\": {\"mean\": " << s.mean * 1000.0 << ", \"p50\": " << s.p50 * 1000.0
+				<< ", \"p90\": " << s.p90 * 1000.0 << ", \"p99\": " << s.p99 * 1000.0 << ", \"min\": " << s.min * 1000.0
+				<< ", \"max\": " << s.max * 1000.0 << "}";
+		}
+		const TraversalStats& t = r.stats.traversal;
+		const double walks = double(std::max<uint64_t>(t.walks, 1));
+		out << ", \"traversal\": {\"nodes_per_walk\": " << double(t.nodes_visited) / walks << ", \"clusters_per_walk\": "
+			<< double(t.clusters_accepted) / walks << ", \"leaf_interactions_per_walk\": " << double(t.leaf_interactions) / walks
+			<< ", \"max_stack_depth\": " << t.max_stack_depth << ", \"leaf_depths\": [";
+		for (size_t d = 0, n = r.stats.leaf_depths.maxDepth(); d <= n; d++)
+		{
+			out << (d > 0 ? ", " : "") << r.stats.leaf_depths.counts[d];
+		}
+		out << "]}";
+		if (config.counters)
+		{
+			// Per interaction, null where the host doesn't offer the counter
+			out << ", \"counters\": {";
+			for (size_t phase = 0; phase < 4; phase++)
+			{
+				const PerfSample& s = r.perf[phase];
+				out << (phase > 0 ? ", \"" : "\"") << PERF_PHASES[phase] << "\": {\"ipc\": ";
+				if (s.ipc() > 0.0)
+					out << s.ipc();
+				else
+					out << "null";
+				for (size_t e = 0; e < PERF_EVENTS; e++)
+				{
+					out << ", \"" << PerfEventName(PerfEvent(e)) << "\": ";
+					if (s.valid[e] && r.stats.evaluated > 0)
+						out << s.values[e] / double(r.stats.evaluated);
+					else
+						out << "null";
+				}
+				out << "}";
+			}
+			out << "}";
+		}
+		if (!config.trajectory.empty())
+		{
+			const TrajectoryStats& w = r.trajectory;
+			out << ", \"trajectory\": {\"frames\": " << w.frames << ", \"dropped\": " << w.dropped << ", \"compression\": "
+				<< double(w.raw_bytes) / double(std::max<size_t>(w.file_bytes, 1)) << ", \"encode_ms\": " << w.encode * 1000.0
+				<< ", \"write_ms\": " << w.write * 1000.0 << ", \"max_submit_ms\": " << w.max_submit * 1000.0 << ", \"max_error\": " << w.max_error;
+			if (config.accuracy)
+				out << ", \"measured_error\": " << r.trajectory_error;
+			out << "}";
+		}
+		if (config.accuracy)
+		{
+			out << ", \"accuracy\": {\"samples\": " << r.accuracy.samples << ", \"rms_error\": " << r.accuracy.rms_error
+				<< ", \"max_error\": " << r.accuracy.max_error << "}";
+		}
+		out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "]\n";
+	out.flush();
+}
+
+inline void PrintBenchmarkUsage(const char* program, std::ostream& out)
+{
+	out << "Usage: " << program << " [options]\n"
+		"Options taking a list sweep every value, given comma separated.\n"
+		"  --bodies N[,N...]        body counts (100000)\n"
+		"  --threads N[,N...]       worker threads, 0 for every hardware thread (0)\n"
+		"  --engine E[,E...]        v1, v2, pointer, linear, karras or fmm (karras)\n"
+		"  --opening X[,X...]       opening angle, or radius for the radius criterion (0.5)\n"
+		"  --criterion C            radius, barnes-hut or salmon-warren (barnes-hut)\n"
+		"  --generator G            uniform, plummer, hernquist, disk, clustered or coincident (uniform)\n"
+		"  --seed N                 initial conditions seed (5489)\n"
+		"  --steps N                timed steps per case (10)\n"
+		"  --warmup N               untimed steps before them (1)\n"
+		"  --dt X                   time step (1/60)\n"
+		"  --G X                    gravitational constant (6.67408e-11)\n"
+		"  --isa I                  widest kernel: scalar, avx2 or avx512 (avx512)\n"
+		"  --quadrupoles            add quadrupole moments to accepted cells\n"
+		"  --counters               read hardware counters per phase (Linux)\n"
+		"  --group-size N           bodies sharing one walk of the linear octree (64)\n"
+		"  --format F               csv or json (csv)\n"
+		"  --snapshot FILE          start from the first bodies of FILE rather than the generator\n"
+		"  --write-snapshot FILE    write the bodies of the largest case to FILE and exit\n"
+		"  --snapshot-layout L      packed or soa, for --write-snapshot (packed)\n"
+		"  --trajectory FILE        write positions to FILE in the background as each case runs\n"
+		"  --trajectory-every N     steps between trajectory frames (1)\n"
+		"  --trajectory-codec C     raw, xor (lossless delta against the last frame) or quantised (xor)\n"
+		"  --trajectory-error X     largest position error of the quantised codec (1e-4)\n"
+		"  --order O                input, morton or hilbert body order after each linear octree build (input)\n"
+		"  --mixed                  walk with the mixed precision kernels, but for the fmm\n"
+		"  --accuracy               measure forces against direct summation on a sample after each case,\n"
+		"                           and read --trajectory back\n"
+		"  --error-budget X         as --accuracy, failing if any case's RMS relative error is above X\n";
+}
+
+// Parses the comma separated list text with parse, false if any entry fails
+template <typename T, typename Parse>
+bool ParseList(const char* text, std::vector<T>& res, Parse parse)
+{
+	res.clear();
+	std::string item;
+	for (const char* c = text;; c++)
+	{
+		if (*c == ',' || *c == '\0')
+		{
+			T value;
+			if (item.empty() || !parse(item.c_str(), value))
+			{
+				return false;
+			}
+			res.push_back(value);
+			item.clear();
+			if (*c == '\0')
+			{
+				return true;
+			}
+		}
+		else
+		{
+			item += *c;
+		}
+	}
+}
+
+// Digits only: strtoull would take a sign or leading space, and wrap a negative value
+inline bool ParseSize(const char* text, size_t& res)
+{
+	if (*text < '0' || *text > '9')
+	{
+		return false;
+	}
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long long v = std::strtoull(text, &end, 10);
+	res = size_t(v);
+	return *end == '\0' && errno != ERANGE && v <= SIZE_MAX;
+}
+
+// As ParseSize(), rejecting 0
+inline bool ParseCount(const char* text, size_t& res)
+{
+	return ParseSize(text, res) && res > 0;
+}
+
+const constexpr size_t MAX_BODIES = UINT32_MAX; //! The trees index bodies with uint32_t
+
+// As ParseCount(), up to MAX_BODIES
+inline bool ParseBodyCount(const char* text, size_t& res)
+{
+	return ParseCount(text, res) && res <= MAX_BODIES;
+}
+
+inline bool ParseDouble(const char* text, double& res)
+{
+	char* end = nullptr;
+	res = std::strtod(text, &end);
+	return *text != '\0' && *end == '\0';
+}
+
+inline bool ParseEngine(const char* text, Engine& res)
+{
+	for (auto e : { Engine::V1, Engine::V2, Engine::Pointer, Engine::Linear, Engine::Karras, Engine::Fmm })
+	{
+		if (std::strcmp(text, EngineName(e)) == 0)
+		{
+			res = e;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Fills config from argv, reporting the first bad option to err. Returns false on error
+// or when help was asked for.
+inline bool ParseBenchmarkArgs(int argc, char** argv, BenchmarkConfig& config, std::ostream& err)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char* option = argv[i];
+		if (std::strcmp(option, "--help") == 0 || std::strcmp(option, "-h") == 0)
+		{
+			PrintBenchmarkUsage(argv[0], err);
+			return false;
+		}
+		if (std::strcmp(option, "--quadrupoles") == 0)
+		{
+			config.quadrupoles = true;
+			continue;
+		}
+		if (std::strcmp(option, "--counters") == 0)
+		{
+			config.counters = true;
+			continue;
+		}
+		if (std::strcmp(option, "--mixed") == 0)
+		{
+			config.mixed = true;
+			continue;
+		}
+		if (std::strcmp(option, "--accuracy") == 0)
+		{
+			config.accuracy = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			err << "Missing value for " << option << "\n";
+			return false;
+		}
+
+		const char* value = argv[++i];
+		bool ok = false;
+		size_t n = 0;
+		if (std::strcmp(option, "--bodies") == 0)
+			ok = ParseList(value, config.bodies, ParseBodyCount);
+		else if (std::strcmp(option, "--threads") == 0)
+			ok = ParseList(value, config.threads, ParseSize);
+		else if (std::strcmp(option, "--engine") == 0)
+			ok = ParseList(value, config.engines, ParseEngine);
+		else if (std::strcmp(option, "--opening") == 0)
+			ok = ParseList(value, config.openings, ParseDouble);
+		else if (std::strcmp(option, "--criterion") == 0)
+		{
+			for (auto c : { CriterionType::Radius, CriterionType::BarnesHut, CriterionType::SalmonWarren })
+			{
+				if (std::strcmp(value, CriterionTypeName(c)) == 0)
+				{
+					config.criterion = c;
+					ok = true;
+				}
+			}
+		}
+		else if (std::strcmp(option, "--generator") == 0)
+			ok = ParseInitialConditions(value, config.generator);
+		else if (std::strcmp(option, "--seed") == 0)
+		{
+			ok = ParseSize(value, n);
+			config.seed = n;
+		}
+		else if (std::strcmp(option, "--steps") == 0)
+			ok = ParseSize(value, config.steps) && config.steps > 0;
+		else if (std::strcmp(option, "--warmup") == 0)
+			ok = ParseSize(value, config.warmup);
+		else if (std::strcmp(option, "--dt") == 0)
+			ok = ParseDouble(value, config.dt);
+		else if (std::strcmp(option, "--G") == 0)
+			ok = ParseDouble(value, config.G);
+		else if (std::strcmp(option, "--isa") == 0)
+		{
+			for (auto isa : { SimdIsa::Scalar, SimdIsa::AVX2, SimdIsa::AVX512 })
+			{
+				if (std::strcmp(value, SimdIsaOption(isa)) == 0)
+				{
+					config.isa = isa;
+					ok = true;
+				}
+			}
+		}
+		else if (std::strcmp(option, "--group-size") == 0)
+		{
+			ok = ParseCount(value, n) && n <= UINT32_MAX;
+			config.group_size = uint32_t(n);
+		}
+		else if (std::strcmp(option, "--snapshot") == 0)
+		{
+			config.snapshot = value;
+			ok = !config.snapshot.empty();
+		}
+		else if (std::strcmp(option, "--write-snapshot") == 0)
+		{
+			config.write_snapshot = value;
+			ok = !config.write_snapshot.empty();
+		}
+		else if (std::strcmp(option, "--snapshot-layout") == 0)
+			ok = ParseSnapshotLayout(value, config.snapshot_layout);
+		else if (std::strcmp(option, "--trajectory") == 0)
+		{
+			config.trajectory = value;
+			ok = !config.trajectory.empty();
+		}
+		else if (std::strcmp(option, "--trajectory-every") == 0)
+			ok = ParseSize(value, config.trajectory_every) && config.trajectory_every > 0;
+		else if (std::strcmp(option, "--trajectory-codec") == 0)
+			ok = ParseFrameCodec(value, config.trajectory_codec);
+		else if (std::strcmp(option, "--order") == 0)
+			ok = ParseBodyOrder(value, config.body_order);
+		else if (std::strcmp(option, "--trajectory-error") == 0)
+			ok = ParseDouble(value, config.trajectory_error) && config.trajectory_error > 0.0;
+		else if (std::strcmp(option, "--error-budget") == 0)
+		{
+			ok = ParseDouble(value, config.error_budget) && config.error_budget > 0.0;
+			config.accuracy = true;
+		}
+		else if (std::strcmp(option, "--format") == 0)
+		{
+			ok = std::strcmp(value, "csv") == 0 || std::strcmp(value, "json") == 0;
+			config.format = std::strcmp(value, "json") == 0 ? OutputFormat::Json : OutputFormat::Csv;
+		}
+		else
+		{
+			err << "Unknown option " << option << "\n";
+			PrintBenchmarkUsage(argv[0], err);
+			return false;
+		}
+
+		if (!ok)
+		{
+			err << "Bad value " << value << " for " << option << "\n";
+			return false;
+		}
+	}
+
+	// The V1 and V2 trees only know the fixed radius test, and the FMM takes --opening as
+	// its opening angle, which a radius isn't
+	for (Engine engine : config.engines)
+	{
+		if ((engine == Engine::V1 || engine == Engine::V2) && config.criterion != CriterionType::Radius)
+		{
+			err << "Engine " << EngineName(engine) << " needs --criterion radius\n";
+			return false;
+		}
+		if (engine == Engine::Fmm && config.criterion == CriterionType::Radius)
+		{
+			err << "Engine fmm needs --criterion barnes-hut or salmon-warren\n";
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "Vec4.h"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+/*
+	Allocator handing out storage aligned to a cache line, so every SoA stream
+	starts on a vector register boundary.
+*/
+template <typename T, size_t Align = 64>
+struct AlignedAllocator {
+	using value_type = T;
+
+	template <typename U>
+	struct rebind {
+		using other = AlignedAllocator<U, Align>;
+	};
+
+	AlignedAllocator() { }
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Align>&) { }
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+	}
+
+	void deallocate(T* p, size_t) {
+		::operator delete(p, std::align_val_t(Align));
+	}
+
+	template <typename U>
+	bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+
+	template <typename U>
+	bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
+};
+
+/*
+	Structure-of-arrays body storage: one contiguous, aligned stream per component.
+*/
+template <typename F>
+struct BodyArrays {
+	using NumericalT = F;
+	using Stream = std::vector<F, AlignedAllocator<F>>;
+
+	Stream x;
+	Stream y;
+	Stream z;
+	Stream m;
+
+	size_t size() const {
+		return x.size();
+	}
+
+	bool empty() const {
+		return x.empty();
+	}
+
+	void reserve(size_t n) {
+		x.reserve(n); y.reserve(n); z.reserve(n); m.reserve(n);
+	}
+
+	void resize(size_t n) {
+		x.resize(n); y.resize(n); z.resize(n); m.resize(n);
+	}
+
+	void clear() {
+		x.clear(); y.clear(); z.clear(); m.clear();
+	}
+
+	void push_back(const Vector4<F>& p) {
+		x.push_back(p.x);
+		y.push_back(p.y);
+		z.push_back(p.z);
+		m.push_back(p.w);
+	}
+
+	Vector4<F> operator[](size_t i) const {
+		return Vector4<F>(x[i], y[i], z[i], m[i]);
+	}
+
+	void set(size_t i, const Vector4<F>& p) {
+		x[i] = p.x;
+		y[i] = p.y;
+		z[i] = p.z;
+		m[i] = p.w;
+	}
+
+	static BodyArrays fromPoints(const std::vector<Vector4<F>>& points) {
+		BodyArrays res;
+		res.reserve(points.size());
+		for (auto& p : points)
+			res.push_back(p);
+		return res;
+	}
+
+	std::vector<Vector4<F>> toPoints() const {
+		std::vector<Vector4<F>> res;
+		res.reserve(size());
+		for (size_t i = 0; i < size(); ++i)
+			res.push_back((*this)[i]);
+		return res;
+	}
+};
+
+using Bodies = BodyArrays<double>;
+
+// Run of bodies in an array, such as a group of neighbours sharing one tree walk
+struct PointRange {
+	uint32_t first;
+	uint32_t count;
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "LinearOctree.h"
+#include "Morton.h"
+#include "ThreadPool.h"
+#include "Vec4.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+	Space filling curve body order.
+
+	Bodies left in the order they were generated or loaded send consecutive targets of a
+	force pass, and consecutive iterations of the integrator, to opposite ends of the
+	tree, so each walk starts with a cold cache. BodyReorder permutes the body arrays along
+	a space filling curve after a tree build instead, so neighbouring targets share most of
+	their walk and the nodes and sources it touches stay cached from one to the next.
+
+	Morton order is the tree's own sorted order and costs only the gathers. Hilbert order
+	sorts again on Hilbert keys over the same grid: the curve never jumps across the cube,
+	so a run of bodies covers a more compact region than a Morton run, at the price of the
+	sort.
+
+	The permutation goes through every per body array handed to apply(), and the tree's
+	indices are renumbered to match, so it needn't be rebuilt. The input index of the body
+	in each slot is kept across reorders, so restore() puts any array back in input order
+	for output.
+*/
+enum class BodyOrder {
+	Input,   //! As generated or loaded
+	Morton,  //! The linear octree's order
+	Hilbert,
+};
+
+inline const char* BodyOrderName(BodyOrder order)
+{
+	switch (order)
+	{
+	case BodyOrder::Input: return "input";
+	case BodyOrder::Morton: return "morton";
+	case BodyOrder::Hilbert: return "hilbert";
+	}
+	return "unknown";
+}
+
+inline bool ParseBodyOrder(const char* name, BodyOrder& res)
+{
+	for (auto order : { BodyOrder::Input, BodyOrder::Morton, BodyOrder::Hilbert })
+	{
+		if (std::strcmp(name, BodyOrderName(order)) == 0)
+		{
+			res = order;
+			return true;
+		}
+	}
+	return false;
+}
+
+// 63-bit Hilbert key of a cell of the Morton grid, by Skilling's transform of the
+// coordinates into the curve's transposed form, then interleaved as a Morton key
+inline uint64_t HilbertEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+	uint32_t axes[3] = { x & MORTON_MAX, y & MORTON_MAX, z & MORTON_MAX };
+
+	// Undo the rotations and reflections of every level, from the top
+	for (uint32_t q = 1u << (MORTON_BITS - 1); q > 1; q >>= 1)
+	{
+		const uint32_t p = q - 1;
+		for (unsigned i = 0; i < 3; i++)
+		{
+			if (axes[i] & q)
+			{
+				axes[0] ^= p;
+			}
+			else
+			{
+				const uint32_t t = (axes[0] ^ axes[i]) & p;
+				axes[0] ^= t;
+				axes[i] ^= t;
+			}
+		}
+	}
+
+	// Gray code
+	axes[1] ^= axes[0];
+	axes[2] ^= axes[1];
+	uint32_t t = 0;
+	for (uint32_t q = 1u << (MORTON_BITS - 1); q > 1; q >>= 1)
+	{
+		if (axes[2] & q)
+		{
+			t ^= q - 1;
+		}
+	}
+	for (auto& a : axes)
+	{
+		a ^= t;
+	}
+
+	return MortonEncode(axes[0], axes[1], axes[2]);
+}
+
+class BodyReorder {
+	BodyOrder order = BodyOrder::Input;
+	std::vector<uint32_t> ids;          //! Input index of the body in each slot, empty while in input order
+	std::vector<uint32_t> moves;        //! Slot each body is gathered from by the reorder under way
+	std::vector<uint32_t> slots;        //! Slot each body goes to, the inverse of moves
+	std::vector<uint64_t> keys;
+	std::vector<uint64_t> key_scratch;
+	std::vector<uint32_t> index_scratch;
+	std::vector<Vec4> scratch;
+
+public:
+	static const constexpr size_t GRAIN = 4096; //! Bodies per task when gathering
+
+	void setOrder(BodyOrder o)
+	{
+		order = o;
+	}
+
+	BodyOrder getOrder() const
+	{
+		return order;
+	}
+
+	// Permute attributes, vectors of one Vec4 per body, into the curve order of tree, which
+	// must just have been built over the positions among them. Renumbers tree to match.
+	template <typename... Attributes>
+	void apply(LinearOctree& tree, ThreadPool& pool, Attributes&... attributes)
+	{
+		const size_t n = tree.size();
+		if (order == BodyOrder::Input || n == 0)
+		{
+			return;
+		}
+		if (ids.size() != n)
+		{
+			ids.resize(n);
+			for (size_t i = 0; i < n; i++)
+			{
+				ids[i] = static_cast<uint32_t>(i);
+			}
+		}
+
+		plan(tree, pool);
+		(gather(attributes, scratch, pool), ...);
+		gather(ids, index_scratch, pool);
+
+		slots.resize(n);
+		pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				slots[moves[k]] = static_cast<uint32_t>(k);
+			}
+		});
+		tree.renumber(slots, pool);
+	}
+
+	// Input index of the body in each slot, empty if the bodies have never been reordered
+	const std::vector<uint32_t>& getIds() const
+	{
+		return ids;
+	}
+
+	// values, one per slot, put back in input order into out
+	template <typename T>
+	void restore(const std::vector<T>& values, std::vector<T>& out) const
+	{
+		if (ids.empty())
+		{
+			out = values;
+			return;
+		}
+		out.resize(values.size());
+		for (size_t k = 0; k < values.size(); k++)
+		{
+			out[ids[k]] = values[k];
+		}
+	}
+
+	// The reverse of restore(), for values given in input order
+	template <typename T>
+	void permute(const std::vector<T>& values, std::vector<T>& out) const
+	{
+		if (ids.empty())
+		{
+			out = values;
+			return;
+		}
+		out.resize(values.size());
+		for (size_t k = 0; k < values.size(); k++)
+		{
+			out[k] = values[ids[k]];
+		}
+	}
+
+private:
+	void plan(const LinearOctree& tree, ThreadPool& pool)
+	{
+		const auto& indices = tree.getSortedIndices();
+		if (order == BodyOrder::Morton)
+		{
+			moves = indices;
+			return;
+		}
+
+		// Hilbert keys over the tree's grid, sorted with the slot of each body
+		const auto& points = tree.getSortedPoints();
+		const MortonBounds& bounds = tree.getBounds();
+		keys.resize(points.size());
+		moves.resize(points.size());
+		pool.parallelFor(0, points.size(), GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const Vec4& p = points[i];
+				keys[i] = HilbertEncode(bounds.quantise(p.x, bounds.centre.x), bounds.quantise(p.y, bounds.centre.y),
+					bounds.quantise(p.z, bounds.centre.z));
+				moves[i] = indices[i];
+			}
+		});
+		MortonRadixSortParallel(keys, moves, key_scratch, index_scratch, pool);
+	}
+
+	template <typename T>
+	void gather(std::vector<T>& values, std::vector<T>& buffer, ThreadPool& pool)
+	{
+		buffer.resize(values.size());
+		pool.parallelFor(0, values.size(), GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				buffer[k] = values[moves[k]];
+			}
+		});
+		values.swap(buffer);
+	}
+};
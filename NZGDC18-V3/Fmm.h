@@ -0,0 +1,393 @@
+#pragma once
+
+#include "Bodies.h"
+#include "ForceKernels.h"
+#include "LinearOctree.h"
+#include "Quadrupole.h"
+#include "ThreadPool.h"
+#include "Vec4.h"
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+	Dual-tree fast multipole solver over a LinearOctree (after Dehnen 2002, "A Hierarchical
+	O(N) Force Calculation Algorithm").
+
+	Instead of every body walking the tree, pairs of cells are walked together. A pair that
+	is well separated, (bmax_a + bmax_b) < theta * |com_a - com_b|, becomes one cell-cell
+	interaction: the source's monopole and quadrupole are translated (M2L) into a local
+	expansion about the target's centre of mass, holding the field there and its first two
+	derivatives, so the error falls off as theta cubed like the quadrupole itself.
+	Pairs that aren't split the larger cell. Pairs of small cells are summed directly with
+	the batched force kernel instead: their bodies are contiguous in Morton order, and a
+	translation would cost more than the handful of body-body terms it replaces. A
+	downward pass then shifts each local expansion into the children (L2L) and evaluates
+	it at the bodies in the leaves (L2P).
+
+	The target tree is cut into subtrees that are walked against the whole tree as
+	independent tasks, each writing only its own cells and bodies. The tree must come
+	straight from a build: cells holding loose points after a refit aren't supported.
+*/
+class FmmSolver {
+public:
+	// Field about a cell's centre of mass, as a second order Taylor expansion
+	struct LocalExpansion {
+		Vec4 acceleration; //! Field at the centre of mass
+		double t[6];       //! Its gradient: xx xy xz yy yz zz
+		double k[10];      //! Its second derivative: xxx xxy xxz xyy xyz xzz yyy yyz yzz zzz
+	};
+
+	static const constexpr double THETA = 0.5; //! Default opening angle
+	static const constexpr uint32_t DIRECT_SIZE = 16; //! Cells this small are summed directly against each other
+	static const constexpr size_t DIRECT_PAIRS = 16; //! Separated pairs with fewer body pairs are summed directly too
+
+private:
+	using Pair = std::pair<uint32_t, uint32_t>; //! Target cell, source cell
+
+	double theta;
+	std::vector<LocalExpansion> locals;
+	std::vector<Vec4> sorted_accelerations;
+	Bodies sources;                          //! Sorted points as SoA for the direct sums
+	std::vector<uint32_t> tasks;
+	std::vector<uint32_t> frontier;
+	std::vector<std::vector<Pair>> stacks;
+	std::vector<std::vector<uint32_t>> descents;
+	std::vector<size_t> interactions;
+
+public:
+	explicit FmmSolver(double theta = THETA)
+		: theta(theta)
+	{
+	}
+
+	void setTheta(double t)
+	{
+		theta = t;
+	}
+
+	double getTheta() const
+	{
+		return theta;
+	}
+
+	// Acceleration of every body in tree, in the original order of the points it was built
+	// from. Uses the tree's quadrupoles when it has them. Returns the number of interactions
+	// evaluated, body-body and cell-cell alike.
+	size_t run(const LinearOctree& tree, double G, ForceKernel kernel, ThreadPool& pool, std::vector<Vec4>& accelerations)
+	{
+		const auto& nodes = tree.getNodes();
+		const auto& sorted = tree.getSortedPoints();
+		const auto& indices = tree.getSortedIndices();
+		const size_t n = sorted.size();
+
+		accelerations.assign(n, Vec4(0.0, 0.0, 0.0, 0.0));
+		if (n == 0)
+		{
+			return 0;
+		}
+
+		LocalExpansion zero = {};
+		zero.acceleration = Vec4(0.0, 0.0, 0.0, 0.0);
+		locals.assign(nodes.size(), zero);
+		sorted_accelerations.assign(n, Vec4(0.0, 0.0, 0.0, 0.0));
+
+		sources.resize(n);
+		pool.parallelFor(0, n, 4096, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				sources.set(i, sorted[i]);
+			}
+		});
+
+		splitTasks(nodes, pool.size() * 8);
+
+		stacks.resize(pool.size());
+		descents.resize(pool.size());
+		interactions.assign(pool.size(), 0);
+
+		pool.parallelFor(0, tasks.size(), 1, [&](size_t begin, size_t end, size_t worker)
+		{
+			for (size_t t = begin; t < end; t++)
+			{
+				interactions[worker] += interact(tree, tasks[t], G, kernel, stacks[worker]);
+				evaluate(tree, tasks[t], descents[worker]);
+			}
+		});
+
+		pool.parallelFor(0, n, 4096, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				accelerations[indices[i]] = sorted_accelerations[i];
+			}
+		});
+
+		size_t total = 0;
+		for (auto c : interactions)
+			total += c;
+		return total;
+	}
+
+private:
+	// Cut the tree into at least count subtrees where possible, widening one level at a time
+	void splitTasks(const std::vector<LinearOctree::Node>& nodes, size_t count)
+	{
+		tasks.assign(1, 0);
+		bool split = true;
+		while (split && tasks.size() < count)
+		{
+			split = false;
+			frontier.clear();
+			for (auto t : tasks)
+			{
+				const auto& node = nodes[t];
+				if (node.child_count == 0)
+				{
+					frontier.push_back(t);
+					continue;
+				}
+
+				assert(node.loose_count == 0);
+				for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+				{
+					frontier.push_back(c);
+				}
+				split = true;
+			}
+			tasks.swap(frontier);
+		}
+	}
+
+	// Walk the target subtree against the whole tree, collecting local expansions and
+	// direct sums
+	size_t interact(const LinearOctree& tree, uint32_t target, double G, ForceKernel kernel, std::vector<Pair>& stack)
+	{
+		const auto& nodes = tree.getNodes();
+		const double theta_sqr = theta * theta;
+		size_t count = 0;
+
+		stack.clear();
+		stack.push_back(Pair(target, 0));
+		while (!stack.empty())
+		{
+			const Pair pair = stack.back();
+			stack.pop_back();
+
+			const auto& a = nodes[pair.first];
+			const auto& b = nodes[pair.second];
+			if (a.point_count == 0 || b.point_count == 0)
+			{
+				continue;
+			}
+
+			const size_t pairs = size_t(a.point_count) * b.point_count;
+			if (pair.first != pair.second)
+			{
+				const double dist_sqr = (a.origin - b.origin).normSquared();
+				const double size = double(a.bmax) + double(b.bmax);
+				if (size * size < theta_sqr * dist_sqr)
+				{
+					if (pairs > DIRECT_PAIRS)
+					{
+						translate(tree, pair.first, pair.second, G);
+						count++;
+					}
+					else
+					{
+						direct(a, b, G, kernel);
+						count += pairs;
+					}
+					continue;
+				}
+			}
+
+			if ((a.point_count <= DIRECT_SIZE && b.point_count <= DIRECT_SIZE) || (a.child_count == 0 && b.child_count == 0))
+			{
+				direct(a, b, G, kernel);
+				count += pairs;
+				continue;
+			}
+
+			// Split the larger cell
+			if (a.child_count == 0 || (b.child_count != 0 && b.bmax > a.bmax))
+			{
+				assert(b.loose_count == 0);
+				for (uint32_t c = b.first_child; c < b.first_child + b.child_count; c++)
+				{
+					stack.push_back(Pair(pair.first, c));
+				}
+			}
+			else
+			{
+				assert(a.loose_count == 0);
+				for (uint32_t c = a.first_child; c < a.first_child + a.child_count; c++)
+				{
+					stack.push_back(Pair(c, pair.second));
+				}
+			}
+		}
+		return count;
+	}
+
+	// M2L: field of source's monopole and quadrupole about the centre of mass of target.
+	// The gradient takes both, the second derivative only the monopole, which keeps every
+	// term to the same order.
+	void translate(const LinearOctree& tree, uint32_t target, uint32_t source, double G)
+	{
+		const auto& nodes = tree.getNodes();
+		const Vec4& za = nodes[target].origin;
+		const Vec4& zb = nodes[source].origin;
+		const double gm = G * zb.w;
+
+		const Vec4 r = za - zb;
+		const double r2 = r.normSquared();
+		const double inv_r = 1.0 / std::sqrt(r2);
+		const double inv_r2 = inv_r * inv_r;
+		const double inv_r3 = inv_r2 * inv_r;
+		const double inv_r5 = inv_r3 * inv_r2;
+		const double inv_r7 = inv_r5 * inv_r2;
+		const double x = r.x;
+		const double y = r.y;
+		const double z = r.z;
+
+		LocalExpansion& local = locals[target];
+
+		// Monopole: G M D1, G M D2 and G M D3 of 1 / |r|
+		local.acceleration -= (gm * inv_r3) * r;
+
+		const double c5 = 3.0 * gm * inv_r5;
+		const double c3 = gm * inv_r3;
+		local.t[0] += c5 * x * x - c3;
+		local.t[1] += c5 * x * y;
+		local.t[2] += c5 * x * z;
+		local.t[3] += c5 * y * y - c3;
+		local.t[4] += c5 * y * z;
+		local.t[5] += c5 * z * z - c3;
+
+		const double c7 = 15.0 * gm * inv_r7;
+		local.k[0] += -c7 * x * x * x + 3.0 * c5 * x;
+		local.k[1] += -c7 * x * x * y + c5 * y;
+		local.k[2] += -c7 * x * x * z + c5 * z;
+		local.k[3] += -c7 * x * y * y + c5 * x;
+		local.k[4] += -c7 * x * y * z;
+		local.k[5] += -c7 * x * z * z + c5 * x;
+		local.k[6] += -c7 * y * y * y + 3.0 * c5 * y;
+		local.k[7] += -c7 * y * y * z + c5 * z;
+		local.k[8] += -c7 * y * z * z + c5 * y;
+		local.k[9] += -c7 * z * z * z + 3.0 * c5 * z;
+
+		if (!tree.hasQuadrupoles())
+		{
+			return;
+		}
+
+		// Quadrupole: G / 6 Q_jk D3_ijk and G / 6 Q_kl D4_ijkl
+		const Quadrupole& q = tree.getQuadrupoles()[source];
+		local.acceleration += QuadrupoleForce(Vec4(za.x, za.y, za.z, 1.0), zb, q, G);
+
+		const double qx = q.xx * x + q.xy * y + q.xz * z;
+		const double qy = q.xy * x + q.yy * y + q.yz * z;
+		const double qz = q.xz * x + q.yz * y + q.zz * z;
+		const double rqr = x * qx + y * qy + z * qz;
+		const double a = G / 6.0 * 105.0 * rqr * inv_r7 * inv_r2;
+		const double b = G / 6.0 * 15.0 * inv_r7;
+		const double c = G / 6.0 * 6.0 * inv_r5;
+		local.t[0] += a * x * x - b * (rqr + 4.0 * x * qx) + c * q.xx;
+		local.t[1] += a * x * y - b * 2.0 * (y * qx + x * qy) + c * q.xy;
+		local.t[2] += a * x * z - b * 2.0 * (z * qx + x * qz) + c * q.xz;
+		local.t[3] += a * y * y - b * (rqr + 4.0 * y * qy) + c * q.yy;
+		local.t[4] += a * y * z - b * 2.0 * (z * qy + y * qz) + c * q.yz;
+		local.t[5] += a * z * z - b * (rqr + 4.0 * z * qz) + c * q.zz;
+	}
+
+	// P2P: every body of target against every body of source
+	void direct(const LinearOctree::Node& target, const LinearOctree::Node& source, double G, ForceKernel kernel)
+	{
+		const uint32_t first = source.first_point;
+		for (uint32_t p = target.first_point; p < target.first_point + target.point_count; p++)
+		{
+			const Vec4 body(sources.x[p], sources.y[p], sources.z[p], 1.0);
+			kernel(body, sources.x.data() + first, sources.y.data() + first, sources.z.data() + first, sources.m.data() + first,
+				source.point_count, G, sorted_accelerations[p]);
+		}
+	}
+
+	// L2L and L2P: push the expansions of the target subtree down to its bodies
+	void evaluate(const LinearOctree& tree, uint32_t target, std::vector<uint32_t>& stack)
+	{
+		const auto& nodes = tree.getNodes();
+		stack.clear();
+		stack.push_back(target);
+		while (!stack.empty())
+		{
+			const uint32_t index = stack.back();
+			stack.pop_back();
+
+			const auto& node = nodes[index];
+			const LocalExpansion& local = locals[index];
+			if (node.child_count != 0)
+			{
+				for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+				{
+					shift(local, nodes[c].origin - node.origin, locals[c]);
+					stack.push_back(c);
+				}
+				continue;
+			}
+
+			for (uint32_t p = node.first_point; p < node.first_point + node.point_count; p++)
+			{
+				const Vec4& q = tree.getSortedPoints()[p];
+				sorted_accelerations[p] += evaluate(local, q - node.origin);
+			}
+		}
+	}
+
+	// Gradient of the field at offset d, (T + K d)
+	static void gradient(const LocalExpansion& local, const Vec4& d, double* g)
+	{
+		const double* t = local.t;
+		const double* k = local.k;
+		g[0] = t[0] + k[0] * d.x + k[1] * d.y + k[2] * d.z;
+		g[1] = t[1] + k[1] * d.x + k[3] * d.y + k[4] * d.z;
+		g[2] = t[2] + k[2] * d.x + k[4] * d.y + k[5] * d.z;
+		g[3] = t[3] + k[3] * d.x + k[6] * d.y + k[7] * d.z;
+		g[4] = t[4] + k[4] * d.x + k[7] * d.y + k[8] * d.z;
+		g[5] = t[5] + k[5] * d.x + k[8] * d.y + k[9] * d.z;
+	}
+
+	// Field of local at offset d from its centre, A + T d + 1/2 (K d) d
+	static Vec4 evaluate(const LocalExpansion& local, const Vec4& d)
+	{
+		double g[6];
+		gradient(local, d, g);
+		const double* t = local.t;
+
+		// Averaging the gradient at the centre and at d gives T d + 1/2 (K d) d
+		return Vec4(local.acceleration.x + 0.5 * ((t[0] + g[0]) * d.x + (t[1] + g[1]) * d.y + (t[2] + g[2]) * d.z),
+			local.acceleration.y + 0.5 * ((t[1] + g[1]) * d.x + (t[3] + g[3]) * d.y + (t[4] + g[4]) * d.z),
+			local.acceleration.z + 0.5 * ((t[2] + g[2]) * d.x + (t[4] + g[4]) * d.y + (t[5] + g[5]) * d.z),
+			0.0);
+	}
+
+	// L2L: add local, re-centred at offset d, into child
+	static void shift(const LocalExpansion& local, const Vec4& d, LocalExpansion& child)
+	{
+		double g[6];
+		gradient(local, d, g);
+		child.acceleration += evaluate(local, d);
+		for (int i = 0; i < 6; i++)
+		{
+			child.t[i] += g[i];
+		}
+		for (int i = 0; i < 10; i++)
+		{
+			child.k[i] += local.k[i];
+		}
+	}
+};
@@ -0,0 +1,513 @@
+#pragma once
+
+#include "Vec4.h"
+#include <cmath>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NBODY_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang need each wide kernel tagged with its ISA, MSVC emits any intrinsic as is
+#if defined(NBODY_X86) && (defined(__GNUC__) || defined(__clang__))
+#define NBODY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define NBODY_TARGET(isa)
+#endif
+
+// Force on a from b, the scalar reference every kernel below is checked against
+inline Vec4 Force(const Vec4& a, const Vec4& b, const float G)
+{
+	Vec4 offs = b - a;
+	double r2 = offs.normSquared();
+	if (r2 == 0.0)
+	{
+		return Vec4(0.0, 0.0, 0.0, 0.0);
+	}
+	Vec4 n = offs.normalized();
+	double magnitude = G * ((a.w * b.w) / r2);
+	Vec4 force = magnitude * n;
+	return force;
+}
+
+/*
+	Batched gravity kernels.
+
+	Each kernel takes one target body and a batch of sources in SoA form (leaf points and
+	accepted cluster centres gathered from the octree) and accumulates the pairwise forces
+	into 'force'. Sources coincident with the target contribute nothing, as in Force().
+	The wide kernels replace the sqrt and divide with a reciprocal square root estimate
+	refined by Newton-Raphson.
+*/
+template <typename F>
+using ForceKernelFor = void (*)(const Vec4& target, const F* x, const F* y, const F* z, const F* m,
+	size_t count, double G, Vec4& force);
+
+using ForceKernel = ForceKernelFor<double>;
+
+/*
+	Mixed precision kernels take float sources, stored relative to a nearby origin (the
+	target itself, or the centre of a group of targets) so the offsets keep their precision,
+	and the target relative to the same origin. Pairwise terms are computed in single
+	precision, twice as many per register. Each call sums its batch in single precision
+	lanes and widens the result, so with batches of one InteractionBuffer block a target's
+	force is accumulated in double across blocks.
+*/
+using MixedForceKernel = ForceKernelFor<float>;
+
+enum class SimdIsa {
+	Scalar,
+	AVX2,
+	AVX512,
+};
+
+inline const char* SimdIsaName(SimdIsa isa)
+{
+	switch (isa)
+	{
+	case SimdIsa::AVX2: return "AVX2";
+	case SimdIsa::AVX512: return "AVX-512";
+	default: return "Scalar";
+	}
+}
+
+// Discards every source, so a pass run with it costs only the walk that gathers them
+inline void ForceBatchNone(const Vec4&, const double*, const double*, const double*, const double*, size_t, double, Vec4&)
+{
+}
+
+inline void ForceBatchNoneMixed(const Vec4&, const float*, const float*, const float*, const float*, size_t, double, Vec4&)
+{
+}
+
+inline void ForceBatchScalar(const Vec4& target, const double* x, const double* y, const double* z, const double* m,
+	size_t count, double G, Vec4& force)
+{
+	double fx = 0.0;
+	double fy = 0.0;
+	double fz = 0.0;
+	const double gm = G * target.w;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const double dx = x[i] - target.x;
+		const double dy = y[i] - target.y;
+		const double dz = z[i] - target.z;
+		const double r2 = dx * dx + dy * dy + dz * dz;
+		if (r2 == 0.0)
+		{
+			continue;
+		}
+		const double inv_r = 1.0 / std::sqrt(r2);
+		const double s = gm * m[i] * inv_r * inv_r * inv_r;
+		fx += s * dx;
+		fy += s * dy;
+		fz += s * dz;
+	}
+
+	force.x += fx;
+	force.y += fy;
+	force.z += fz;
+}
+
+inline void ForceBatchScalarMixed(const Vec4& target, const float* x, const float* y, const float* z, const float* m,
+	size_t count, double G, Vec4& force)
+{
+	const float tx = static_cast<float>(target.x);
+	const float ty = static_cast<float>(target.y);
+	const float tz = static_cast<float>(target.z);
+	float fx = 0.0f;
+	float fy = 0.0f;
+	float fz = 0.0f;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const float dx = x[i] - tx;
+		const float dy = y[i] - ty;
+		const float dz = z[i] - tz;
+		const float r2 = dx * dx + dy * dy + dz * dz;
+		if (r2 == 0.0f)
+		{
+			continue;
+		}
+		const float inv_r = 1.0f / std::sqrt(r2);
+		const float s = m[i] * inv_r * inv_r * inv_r;
+		fx += s * dx;
+		fy += s * dy;
+		fz += s * dz;
+	}
+
+	const double gm = G * target.w;
+	force.x += gm * double(fx);
+	force.y += gm * double(fy);
+	force.z += gm * double(fz);
+}
+
+#ifdef NBODY_X86
+
+NBODY_TARGET("avx2,fma")
+inline double HorizontalSum(__m256d v)
+{
+	const __m128d lo = _mm256_castpd256_pd128(v);
+	const __m128d hi = _mm256_extractf128_pd(v, 1);
+	const __m128d pair = _mm_add_pd(lo, hi);
+	return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+NBODY_TARGET("avx2,fma")
+inline void ForceBatchAVX2(const Vec4& target, const double* x, const double* y, const double* z, const double* m,
+	size_t count, double G, Vec4& force)
+{
+	const __m256d tx = _mm256_set1_pd(target.x);
+	const __m256d ty = _mm256_set1_pd(target.y);
+	const __m256d tz = _mm256_set1_pd(target.z);
+	const __m256d gm = _mm256_set1_pd(G * target.w);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d half = _mm256_set1_pd(0.5);
+	const __m256d three_halves = _mm256_set1_pd(1.5);
+	// Smallest r^2 whose single precision estimate is still a normal number
+	const __m256d r2_min = _mm256_set1_pd(1.1754943508222875e-38);
+
+	__m256d fx = zero;
+	__m256d fy = zero;
+	__m256d fz = zero;
+
+	for (size_t i = 0; i < count; i += 4)
+	{
+		__m256d sx, sy, sz, sm;
+		if (i + 4 <= count)
+		{
+			sx = _mm256_loadu_pd(x + i);
+			sy = _mm256_loadu_pd(y + i);
+			sz = _mm256_loadu_pd(z + i);
+			sm = _mm256_loadu_pd(m + i);
+		}
+		else
+		{
+			const long long rem = static_cast<long long>(count - i);
+			const __m256i lane = _mm256_setr_epi64x(0, 1, 2, 3);
+			const __m256i tail = _mm256_cmpgt_epi64(_mm256_set1_epi64x(rem), lane);
+			sx = _mm256_maskload_pd(x + i, tail);
+			sy = _mm256_maskload_pd(y + i, tail);
+			sz = _mm256_maskload_pd(z + i, tail);
+			sm = _mm256_maskload_pd(m + i, tail);
+		}
+
+		const __m256d dx = _mm256_sub_pd(sx, tx);
+		const __m256d dy = _mm256_sub_pd(sy, ty);
+		const __m256d dz = _mm256_sub_pd(sz, tz);
+		const __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+		const __m256d valid = _mm256_cmp_pd(r2, zero, _CMP_GT_OQ);
+
+		// AVX2 has no double precision rsqrt, so start from the single precision estimate
+		// (12 bits) and take two Newton steps to reach ~48 bits
+		const __m256d r2c = _mm256_max_pd(r2, r2_min);
+		__m256d inv_r = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2c)));
+		const __m256d half_r2 = _mm256_mul_pd(half, r2c);
+		inv_r = _mm256_mul_pd(inv_r, _mm256_fnmadd_pd(half_r2, _mm256_mul_pd(inv_r, inv_r), three_halves));
+		inv_r = _mm256_mul_pd(inv_r, _mm256_fnmadd_pd(half_r2, _mm256_mul_pd(inv_r, inv_r), three_halves));
+
+		const __m256d inv_r3 = _mm256_mul_pd(inv_r, _mm256_mul_pd(inv_r, inv_r));
+		const __m256d s = _mm256_and_pd(valid, _mm256_mul_pd(_mm256_mul_pd(gm, sm), inv_r3));
+		fx = _mm256_fmadd_pd(s, dx, fx);
+		fy = _mm256_fmadd_pd(s, dy, fy);
+		fz = _mm256_fmadd_pd(s, dz, fz);
+	}
+
+	force.x += HorizontalSum(fx);
+	force.y += HorizontalSum(fy);
+	force.z += HorizontalSum(fz);
+}
+
+// Pairwise sums of the eight single precision lanes of v, widened to four doubles
+NBODY_TARGET("avx2,fma")
+inline __m256d WidenedSum(__m256 v)
+{
+	return _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+NBODY_TARGET("avx2,fma")
+inline void ForceBatchAVX2Mixed(const Vec4& target, const float* x, const float* y, const float* z, const float* m,
+	size_t count, double G, Vec4& force)
+{
+	const __m256 tx = _mm256_set1_ps(static_cast<float>(target.x));
+	const __m256 ty = _mm256_set1_ps(static_cast<float>(target.y));
+	const __m256 tz = _mm256_set1_ps(static_cast<float>(target.z));
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 three_halves = _mm256_set1_ps(1.5f);
+
+	__m256 fx = zero;
+	__m256 fy = zero;
+	__m256 fz = zero;
+
+	for (size_t i = 0; i < count; i += 8)
+	{
+		__m256 sx, sy, sz, sm;
+		if (i + 8 <= count)
+		{
+			sx = _mm256_loadu_ps(x + i);
+			sy = _mm256_loadu_ps(y + i);
+			sz = _mm256_loadu_ps(z + i);
+			sm = _mm256_loadu_ps(m + i);
+		}
+		else
+		{
+			const int rem = static_cast<int>(count - i);
+			const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			const __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32(rem), lane);
+			sx = _mm256_maskload_ps(x + i, tail);
+			sy = _mm256_maskload_ps(y + i, tail);
+			sz = _mm256_maskload_ps(z + i, tail);
+			sm = _mm256_maskload_ps(m + i, tail);
+		}
+
+		const __m256 dx = _mm256_sub_ps(sx, tx);
+		const __m256 dy = _mm256_sub_ps(sy, ty);
+		const __m256 dz = _mm256_sub_ps(sz, tz);
+		const __m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+		const __m256 valid = _mm256_cmp_ps(r2, zero, _CMP_GT_OQ);
+
+		// 12 bit estimate, one Newton step reaches single precision
+		__m256 inv_r = _mm256_rsqrt_ps(r2);
+		inv_r = _mm256_mul_ps(inv_r, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv_r, inv_r), three_halves));
+
+		const __m256 inv_r3 = _mm256_mul_ps(inv_r, _mm256_mul_ps(inv_r, inv_r));
+		const __m256 s = _mm256_and_ps(valid, _mm256_mul_ps(sm, inv_r3));
+		fx = _mm256_fmadd_ps(s, dx, fx);
+		fy = _mm256_fmadd_ps(s, dy, fy);
+		fz = _mm256_fmadd_ps(s, dz, fz);
+	}
+
+	const double gm = G * target.w;
+	force.x += gm * HorizontalSum(WidenedSum(fx));
+	force.y += gm * HorizontalSum(WidenedSum(fy));
+	force.z += gm * HorizontalSum(WidenedSum(fz));
+}
+
+NBODY_TARGET("avx512f")
+inline double HorizontalSum(__m512d v)
+{
+	alignas(64) double lanes[8];
+	_mm512_store_pd(lanes, v);
+	return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+NBODY_TARGET("avx512f")
+inline void ForceBatchAVX512(const Vec4& target, const double* x, const double* y, const double* z, const double* m,
+	size_t count, double G, Vec4& force)
+{
+	const __m512d tx = _mm512_set1_pd(target.x);
+	const __m512d ty = _mm512_set1_pd(target.y);
+	const __m512d tz = _mm512_set1_pd(target.z);
+	const __m512d gm = _mm512_set1_pd(G * target.w);
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d half = _mm512_set1_pd(0.5);
+	const __m512d three_halves = _mm512_set1_pd(1.5);
+
+	__m512d fx = zero;
+	__m512d fy = zero;
+	__m512d fz = zero;
+
+	for (size_t i = 0; i < count; i += 8)
+	{
+		const size_t rem = count - i;
+		const __mmask8 tail = rem >= 8 ? __mmask8(0xFF) : __mmask8((1u << rem) - 1u);
+		const __m512d sx = _mm512_maskz_loadu_pd(tail, x + i);
+		const __m512d sy = _mm512_maskz_loadu_pd(tail, y + i);
+		const __m512d sz = _mm512_maskz_loadu_pd(tail, z + i);
+		const __m512d sm = _mm512_maskz_loadu_pd(tail, m + i);
+
+		const __m512d dx = _mm512_sub_pd(sx, tx);
+		const __m512d dy = _mm512_sub_pd(sy, ty);
+		const __m512d dz = _mm512_sub_pd(sz, tz);
+		const __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+		const __mmask8 valid = _mm512_mask_cmp_pd_mask(tail, r2, zero, _CMP_GT_OQ);
+
+		// 14 bit estimate, two Newton steps give ~56 bits
+		__m512d inv_r = _mm512_maskz_rsqrt14_pd(valid, r2);
+		const __m512d half_r2 = _mm512_mul_pd(half, r2);
+		inv_r = _mm512_mul_pd(inv_r, _mm512_fnmadd_pd(half_r2, _mm512_mul_pd(inv_r, inv_r), three_halves));
+		inv_r = _mm512_mul_pd(inv_r, _mm512_fnmadd_pd(half_r2, _mm512_mul_pd(inv_r, inv_r), three_halves));
+
+		const __m512d inv_r3 = _mm512_mul_pd(inv_r, _mm512_mul_pd(inv_r, inv_r));
+		const __m512d s = _mm512_maskz_mul_pd(valid, _mm512_mul_pd(gm, sm), inv_r3);
+		fx = _mm512_fmadd_pd(s, dx, fx);
+		fy = _mm512_fmadd_pd(s, dy, fy);
+		fz = _mm512_fmadd_pd(s, dz, fz);
+	}
+
+	force.x += HorizontalSum(fx);
+	force.y += HorizontalSum(fy);
+	force.z += HorizontalSum(fz);
+}
+
+// Pairwise sums of the sixteen single precision lanes of v, widened to eight doubles
+NBODY_TARGET("avx512f")
+inline __m512d WidenedSum(__m512 v)
+{
+	// Zero masked forms with every lane set, the plain ones trip GCC 12's uninitialised warning
+	const __m256 lo = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, _mm512_castps_pd(v), 0));
+	const __m256 hi = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, _mm512_castps_pd(v), 1));
+	return _mm512_add_pd(_mm512_maskz_cvtps_pd(0xFF, lo), _mm512_maskz_cvtps_pd(0xFF, hi));
+}
+
+NBODY_TARGET("avx512f")
+inline void ForceBatchAVX512Mixed(const Vec4& target, const float* x, const float* y, const float* z, const float* m,
+	size_t count, double G, Vec4& force)
+{
+	const __m512 tx = _mm512_set1_ps(static_cast<float>(target.x));
+	const __m512 ty = _mm512_set1_ps(static_cast<float>(target.y));
+	const __m512 tz = _mm512_set1_ps(static_cast<float>(target.z));
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 half = _mm512_set1_ps(0.5f);
+	const __m512 three_halves = _mm512_set1_ps(1.5f);
+
+	__m512 fx = zero;
+	__m512 fy = zero;
+	__m512 fz = zero;
+
+	for (size_t i = 0; i < count; i += 16)
+	{
+		const size_t rem = count - i;
+		const __mmask16 tail = rem >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << rem) - 1u);
+		const __m512 sx = _mm512_maskz_loadu_ps(tail, x + i);
+		const __m512 sy = _mm512_maskz_loadu_ps(tail, y + i);
+		const __m512 sz = _mm512_maskz_loadu_ps(tail, z + i);
+		const __m512 sm = _mm512_maskz_loadu_ps(tail, m + i);
+
+		const __m512 dx = _mm512_sub_ps(sx, tx);
+		const __m512 dy = _mm512_sub_ps(sy, ty);
+		const __m512 dz = _mm512_sub_ps(sz, tz);
+		const __m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+		const __mmask16 valid = _mm512_mask_cmp_ps_mask(tail, r2, zero, _CMP_GT_OQ);
+
+		// 14 bit estimate, one Newton step reaches single precision
+		__m512 inv_r = _mm512_maskz_rsqrt14_ps(valid, r2);
+		inv_r = _mm512_mul_ps(inv_r, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv_r, inv_r), three_halves));
+
+		const __m512 inv_r3 = _mm512_mul_ps(inv_r, _mm512_mul_ps(inv_r, inv_r));
+		const __m512 s = _mm512_maskz_mul_ps(valid, sm, inv_r3);
+		fx = _mm512_fmadd_ps(s, dx, fx);
+		fy = _mm512_fmadd_ps(s, dy, fy);
+		fz = _mm512_fmadd_ps(s, dz, fz);
+	}
+
+	const double gm = G * target.w;
+	force.x += gm * HorizontalSum(WidenedSum(fx));
+	force.y += gm * HorizontalSum(WidenedSum(fy));
+	force.z += gm * HorizontalSum(WidenedSum(fz));
+}
+
+// Highest ISA both the CPU and the OS (saved register state) support
+inline SimdIsa DetectSimdIsa()
+{
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+	{
+		return SimdIsa::Scalar;
+	}
+
+	__cpuid(regs, 1);
+	const bool osxsave = (regs[2] & (1 << 27)) != 0;
+	const bool fma = (regs[2] & (1 << 12)) != 0;
+	if (!osxsave)
+	{
+		return SimdIsa::Scalar;
+	}
+
+	const unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	const bool avx2 = (regs[1] & (1 << 5)) != 0;
+	const bool avx512f = (regs[1] & (1 << 16)) != 0;
+
+	if (avx512f && (xcr0 & 0xE6) == 0xE6)
+	{
+		return SimdIsa::AVX512;
+	}
+	if (avx2 && fma && (xcr0 & 0x6) == 0x6)
+	{
+		return SimdIsa::AVX2;
+	}
+	return SimdIsa::Scalar;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		return SimdIsa::AVX512;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		return SimdIsa::AVX2;
+	}
+	return SimdIsa::Scalar;
+#endif
+}
+
+#else
+
+inline SimdIsa DetectSimdIsa()
+{
+	return SimdIsa::Scalar;
+}
+
+#endif
+
+// Kernel for the requested ISA, falling back to the best one this host can run
+inline ForceKernel GetForceKernel(SimdIsa isa)
+{
+#ifdef NBODY_X86
+	const SimdIsa host = DetectSimdIsa();
+	if (isa == SimdIsa::AVX512 && host == SimdIsa::AVX512)
+	{
+		return ForceBatchAVX512;
+	}
+	if (isa != SimdIsa::Scalar && host != SimdIsa::Scalar)
+	{
+		return ForceBatchAVX2;
+	}
+#else
+	(void)isa;
+#endif
+	return ForceBatchScalar;
+}
+
+inline MixedForceKernel GetMixedForceKernel(SimdIsa isa)
+{
+#ifdef NBODY_X86
+	const SimdIsa host = DetectSimdIsa();
+	if (isa == SimdIsa::AVX512 && host == SimdIsa::AVX512)
+	{
+		return ForceBatchAVX512Mixed;
+	}
+	if (isa != SimdIsa::Scalar && host != SimdIsa::Scalar)
+	{
+		return ForceBatchAVX2Mixed;
+	}
+#else
+	(void)isa;
+#endif
+	return ForceBatchScalarMixed;
+}
+
+// Kernel taking sources of precision F, double or float
+template <typename F>
+ForceKernelFor<F> GetForceKernelFor(SimdIsa isa);
+
+template <>
+inline ForceKernelFor<double> GetForceKernelFor<double>(SimdIsa isa)
+{
+	return GetForceKernel(isa);
+}
+
+template <>
+inline ForceKernelFor<float> GetForceKernelFor<float>(SimdIsa isa)
+{
+	return GetMixedForceKernel(isa);
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "Bodies.h"
+#include "ForceKernels.h"
+#include "InteractionBuffer.h"
+#include "OpeningCriteria.h"
+#include "Quadrupole.h"
+#include "ThreadPool.h"
+#include "TraversalStats.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+	Parallel tree force pass.
+
+	For every target the tree is walked to stream its interactions (leaf points and
+	accepted cluster centres) through a fixed-size SoA InteractionBuffer, each full block
+	going straight to a batched force kernel. Traversal stacks and buffers are kept per
+	worker and reused between passes, so a steady state pass doesn't allocate. With
+	quadrupoles enabled the moments of accepted cells are applied as a scalar correction
+	on top of the kernel's monopoles.
+
+	F picks the precision of the streamed sources and kernels: double, or float for the
+	mixed precision kernels in ForceKernels.h. Sources are streamed relative to the target,
+	or to the centre of a group, and targets are handed to the kernel relative to the same
+	point. Forces are accumulated in double across blocks.
+
+	runGroups() amortises the walk instead: each group of neighbouring bodies from the
+	tree's getGroups() walks it once against the group's bounding box, and every block of
+	the shared list is run through the kernel for each body in the group. The list is
+	conservative, a little longer than any one body's, but the walk is paid once per group.
+	A criterion that leaves bodies out, as the radius criterion does, would have a group
+	keep bodies its members drop, so for those runGroups() walks per body as run() does.
+
+	Each worker's stack counts its walks, and stats() merges them once the pass is done.
+*/
+template <typename Tree, typename F = double>
+class ForcePass {
+	using Buffer = InteractionBuffer<INTERACTION_BLOCK, F>;
+
+	std::vector<typename Tree::TraversalStack> stacks;
+	std::vector<Buffer> buffers;
+	std::vector<size_t> interactions;
+	std::vector<std::vector<Vec4>> group_targets;
+	std::vector<std::vector<Vec4>> group_locals; //! Targets relative to their group's centre
+	std::vector<std::vector<Vec4>> group_forces;
+	std::vector<PointRange> groups;
+	bool quadrupoles = false;
+
+public:
+	using TreeType = Tree;
+
+	static const constexpr size_t GRAIN = 256; //! Targets per work-stealing task
+	static const constexpr uint32_t GROUP_SIZE = 64; //! Default bodies sharing a walk in runGroups()
+
+	// The tree must have been built with quadrupoles for them to contribute
+	void setQuadrupoles(bool enabled)
+	{
+		quadrupoles = enabled;
+	}
+
+	// target(i) yields the i-th target body, store(i, force) receives its force. criterion
+	// is one of the acceptance policies in OpeningCriteria.h.
+	// Returns the number of interactions evaluated.
+	template <typename Criterion, typename Target, typename Store>
+	size_t run(const Tree& tree, size_t count, const Criterion& criterion, double G, ForceKernelFor<F> kernel, ThreadPool& pool,
+		Target target, Store store)
+	{
+		stacks.resize(pool.size());
+		buffers.resize(pool.size());
+		interactions.assign(pool.size(), 0);
+		resetStats();
+
+		pool.parallelFor(0, count, GRAIN, [&](size_t begin, size_t end, size_t worker)
+		{
+			auto& stack = stacks[worker];
+			auto& buffer = buffers[worker];
+			size_t evaluated = 0;
+			for (size_t i = begin; i < end; i++)
+			{
+				const Vec4 p = target(i);
+				const Vec4 local(0.0, 0.0, 0.0, p.w);
+				Vec4 force(0.0, 0.0, 0.0, 0.0);
+				auto consume = [&](const F* x, const F* y, const F* z, const F* m, size_t n)
+				{
+					kernel(local, x, y, z, m, n, G, force);
+				};
+
+				if (quadrupoles)
+				{
+					evaluated += StreamInteractionsWithMoments(tree, p, criterion, stack, buffer, consume,
+						[&](const Vec4& com, const Quadrupole& moment)
+					{
+						force += QuadrupoleForce(p, com, moment, G);
+					});
+				}
+				else
+				{
+					evaluated += StreamInteractions(tree, p, criterion, stack, buffer, consume);
+				}
+				store(i, force);
+			}
+			interactions[worker] += evaluated;
+		});
+
+		return total();
+	}
+
+	// As run(), for every body in the tree and sharing one walk between the up to
+	// group_size bodies of each group. target(i) and store(i, force) take original indices.
+	template <typename Criterion, typename Target, typename Store>
+	size_t runGroups(const Tree& tree, uint32_t group_size, const Criterion& criterion, double G, ForceKernelFor<F> kernel,
+		ThreadPool& pool, Target target, Store store)
+	{
+		if (!Criterion::INCLUDES_ALL)
+		{
+			return run(tree, tree.size(), criterion, G, kernel, pool, target, store);
+		}
+
+		stacks.resize(pool.size());
+		buffers.resize(pool.size());
+		group_targets.resize(pool.size());
+		group_locals.resize(pool.size());
+		group_forces.resize(pool.size());
+		interactions.assign(pool.size(), 0);
+		tree.getGroups(group_size, groups, stacks[0]);
+		resetStats();
+
+		const auto& indices = tree.getSortedIndices();
+		const size_t grain = std::max<size_t>(1, GRAIN / group_size);
+		pool.parallelFor(0, groups.size(), grain, [&](size_t begin, size_t end, size_t worker)
+		{
+			auto& stack = stacks[worker];
+			auto& buffer = buffers[worker];
+			auto& targets = group_targets[worker];
+			auto& locals = group_locals[worker];
+			auto& forces = group_forces[worker];
+			size_t evaluated = 0;
+			for (size_t g = begin; g < end; g++)
+			{
+				const uint32_t first = groups[g].first;
+				const uint32_t count = groups[g].count;
+
+				BoundingBox box;
+				targets.resize(count);
+				locals.resize(count);
+				forces.assign(count, Vec4(0.0, 0.0, 0.0, 0.0));
+				for (uint32_t k = 0; k < count; k++)
+				{
+					targets[k] = target(indices[first + k]);
+					box.add(targets[k]);
+				}
+
+				const Vec4 centre = 0.5 * (box.lo + box.hi);
+				for (uint32_t k = 0; k < count; k++)
+				{
+					const Vec4 d = targets[k] - centre;
+					locals[k] = Vec4(d.x, d.y, d.z, targets[k].w);
+				}
+
+				auto consume = [&](const F* x, const F* y, const F* z, const F* m, size_t n)
+				{
+					for (uint32_t k = 0; k < count; k++)
+					{
+						kernel(locals[k], x, y, z, m, n, G, forces[k]);
+					}
+					evaluated += n * count;
+				};
+
+				buffer.reset(centre);
+				tree.getGroupInteractions(box, criterion, stack, [&](const Vec4& q)
+				{
+					buffer.push(q, consume);
+				}, [&](const Vec4& com, const Quadrupole& moment)
+				{
+					buffer.push(com, consume);
+					if (quadrupoles)
+					{
+						for (uint32_t k = 0; k < count; k++)
+						{
+							forces[k] += QuadrupoleForce(targets[k], com, moment, G);
+						}
+					}
+				});
+				buffer.flush(consume);
+
+				for (uint32_t k = 0; k < count; k++)
+				{
+					store(indices[first + k], forces[k]);
+				}
+			}
+			interactions[worker] += evaluated;
+		});
+
+		return total();
+	}
+
+	// Walk counts of the last pass, merged over the workers, with the leaf depths of the
+	// tree it walked
+	InteractionStats stats(const Tree& tree) const
+	{
+		InteractionStats res;
+		tree.getLeafDepths(res.leaf_depths);
+		for (const auto& stack : stacks)
+		{
+			res.traversal.merge(stack.stats);
+		}
+		res.evaluated = total();
+		return res;
+	}
+
+private:
+	void resetStats()
+	{
+		for (auto& stack : stacks)
+		{
+			stack.stats = TraversalStats();
+		}
+	}
+
+	size_t total() const
+	{
+		size_t res = 0;
+		for (auto n : interactions)
+			res += n;
+		return res;
+	}
+};
@@ -0,0 +1,783 @@
+#pragma once
+
+#include "ForceKernels.h"
+#include "Morton.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+	Frame encodings for trajectory output.
+
+	A frame is the count bodies of one step, positions in xyz and mass in w. Raw frames
+	are the Vec4 array as is. XorDelta frames XOR every double's bits with the same value
+	in the previous frame and keep only the bytes up to the highest non-zero one: bodies
+	move little between steps, so sign, exponent and leading mantissa bytes mostly cancel,
+	and masses cancel entirely. The byte counts go first as one nibble per value, then the
+	bytes. It is lossless and a few instructions per value. Keyframes are coded against
+	zero, so a reader can start from any of them.
+
+	Quantised frames are lossy, see QuantisedGrid below: positions are snapped to a grid
+	no coarser than twice the error bound and only the integer changes are kept.
+*/
+enum class FrameCodec : uint32_t {
+	Raw = 0,
+	XorDelta = 1,
+	Quantised = 2,
+};
+
+inline const char* FrameCodecName(FrameCodec codec)
+{
+	switch (codec)
+	{
+	case FrameCodec::XorDelta:
+		return "xor";
+	case FrameCodec::Quantised:
+		return "quantised";
+	default:
+		return "raw";
+	}
+}
+
+inline bool ParseFrameCodec(const char* name, FrameCodec& res)
+{
+	for (auto codec : { FrameCodec::Raw, FrameCodec::XorDelta, FrameCodec::Quantised })
+	{
+		if (std::strcmp(name, FrameCodecName(codec)) == 0)
+		{
+			res = codec;
+			return true;
+		}
+	}
+	return false;
+}
+
+const constexpr size_t FRAME_CODEC_SLACK = 8; //! Bytes past the end the XorDelta coders may touch
+
+/*
+	Quantised frames.
+
+	A keyframe fits a grid to the bodies' bounding box, widened by QUANTISED_MARGIN on
+	every side, with cells of twice the error bound: every coordinate rounds to the nearest
+	grid point, so it comes back within the bound. Cells are cubes and the grid is at most
+	QUANTISED_BITS to a side, the resolution of a Morton key, so a 16 bit grid covers a box
+	65536 error bounds wide. A box too wide for 21 bits coarsens the grid instead, and the
+	encoder reports the bound it could keep.
+
+	Frames up to the next keyframe reuse the grid and store each coordinate's change since
+	the last frame, which stays within a few cells for bodies moving a little per step. A
+	body drifting off the grid turns the frame into a keyframe. Keyframes store the
+	masses, which delta frames leave out, and the positions in one of two layouts, as
+	QuantisedGrid::layout says. The given order layout stores each coordinate's change from
+	the body before it, small only if the bodies were handed over in spatial order. The
+	Morton layout sorts the bodies by the Morton key of their grid cell and stores each
+	key's gap from the one before, with the ids in that order as changes from the id
+	before: a few bits a body for ids already sorted, and about log2(count) otherwise. The
+	encoder codes both and keeps the smaller. Delta frames keep the order of the bodies
+	given and take each against itself.
+
+	The changes are zigzag coded and bit packed per axis in blocks of QUANTISED_BLOCK,
+	each block a byte for its width and then the values at that width. Snapping to the
+	grid and back are the per body work, and have AVX2 kernels alongside the scalar ones.
+*/
+const constexpr unsigned QUANTISED_BITS = 21;     //! Widest grid, as Morton.h keys
+const constexpr size_t QUANTISED_BLOCK = 16;      //! Changes sharing one bit width
+const constexpr double QUANTISED_MARGIN = 0.125;  //! Grid slack on each side, as a fraction of the box
+const constexpr double QUANTISED_ERROR = 1.0e-4;  //! Default error bound, per coordinate
+
+enum class QuantisedLayout : uint32_t {
+	GivenOrder = 0,
+	MortonOrder = 1,
+};
+
+struct QuantisedGrid {
+	double origin[3];
+	double step;       //! Cell size, twice the error bound kept
+	uint32_t bits;     //! Grid points per axis are 1 << bits
+	uint32_t layout;   //! QuantisedLayout of the last keyframe
+};
+
+// Grid for a keyframe of count bodies keeping positions within max_error, or as close as
+// QUANTISED_BITS allow
+inline QuantisedGrid FitQuantisedGrid(const Vec4* bodies, size_t count, double max_error)
+{
+	double lo[3] = { 0.0, 0.0, 0.0 };
+	double hi[3] = { 0.0, 0.0, 0.0 };
+	for (size_t i = 0; i < count; i++)
+	{
+		for (unsigned a = 0; a < 3; a++)
+		{
+			lo[a] = i == 0 ? bodies[i][a] : std::min(lo[a], bodies[i][a]);
+			hi[a] = i == 0 ? bodies[i][a] : std::max(hi[a], bodies[i][a]);
+		}
+	}
+
+	const double extent = std::max({ hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] });
+	const double size = extent * (1.0 + 2.0 * QUANTISED_MARGIN);
+
+	// A hair under twice the bound, so rounding the reconstruction can't push it over
+	QuantisedGrid grid;
+	grid.step = 2.0 * max_error * (1.0 - 1.0e-6);
+	grid.bits = 1;
+	while (grid.bits < QUANTISED_BITS && size / grid.step >= double((1u << grid.bits) - 1))
+	{
+		grid.bits++;
+	}
+	if (size / grid.step >= double((1u << grid.bits) - 1))
+	{
+		grid.step = size / double((1u << grid.bits) - 2);
+	}
+	grid.layout = uint32_t(QuantisedLayout::GivenOrder);
+
+	// Centre the box on the grid, so the margin is the same on each side of every axis
+	for (unsigned a = 0; a < 3; a++)
+	{
+		grid.origin[a] = 0.5 * (lo[a] + hi[a]) - 0.5 * grid.step * double((1u << grid.bits) - 1);
+	}
+	return grid;
+}
+
+/*
+	Quantised kernels.
+
+	Quantise snaps count bodies to the grid, one int32 stream per axis, and returns false
+	if any lies off it. Dequantise maps the streams back with the masses.
+*/
+using QuantiseKernel = bool (*)(const Vec4* bodies, size_t count, const QuantisedGrid& grid, int32_t* qx, int32_t* qy,
+	int32_t* qz);
+using DequantiseKernel = void (*)(const int32_t* qx, const int32_t* qy, const int32_t* qz, const double* masses,
+	size_t count, const QuantisedGrid& grid, Vec4* bodies);
+
+inline bool QuantiseScalar(const Vec4* bodies, size_t count, const QuantisedGrid& grid, int32_t* qx, int32_t* qy,
+	int32_t* qz)
+{
+	const double scale = 1.0 / grid.step;
+	const double limit = double(1u << grid.bits);
+	int32_t* q[3] = { qx, qy, qz };
+	bool inside = true;
+	for (size_t i = 0; i < count; i++)
+	{
+		for (unsigned a = 0; a < 3; a++)
+		{
+			// Rounds to nearest even, as the vector conversion does
+			const double v = std::nearbyint((bodies[i][a] - grid.origin[a]) * scale);
+			const bool on = v >= 0.0 && v < limit;
+			q[a][i] = on ? int32_t(v) : 0;
+			inside = inside && on;
+		}
+	}
+	return inside;
+}
+
+inline void DequantiseScalar(const int32_t* qx, const int32_t* qy, const int32_t* qz, const double* masses,
+	size_t count, const QuantisedGrid& grid, Vec4* bodies)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		bodies[i] = Vec4(grid.origin[0] + double(qx[i]) * grid.step, grid.origin[1] + double(qy[i]) * grid.step,
+			grid.origin[2] + double(qz[i]) * grid.step, masses[i]);
+	}
+}
+
+#ifdef NBODY_X86
+
+// Four bodies a pass, transposed from xyzw rows into x, y and z lanes
+NBODY_TARGET("avx2,fma")
+inline bool QuantiseAVX2(const Vec4* bodies, size_t count, const QuantisedGrid& grid, int32_t* qx, int32_t* qy,
+	int32_t* qz)
+{
+	const __m256d scale = _mm256_set1_pd(1.0 / grid.step);
+	const __m256d limit = _mm256_set1_pd(double(1u << grid.bits));
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d ox = _mm256_set1_pd(grid.origin[0]);
+	const __m256d oy = _mm256_set1_pd(grid.origin[1]);
+	const __m256d oz = _mm256_set1_pd(grid.origin[2]);
+	const double* in = &bodies[0].x;
+	int outside = 0;
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m256d b0 = _mm256_load_pd(in + 4 * i);
+		const __m256d b1 = _mm256_load_pd(in + 4 * i + 4);
+		const __m256d b2 = _mm256_load_pd(in + 4 * i + 8);
+		const __m256d b3 = _mm256_load_pd(in + 4 * i + 12);
+		const __m256d t0 = _mm256_unpacklo_pd(b0, b1);
+		const __m256d t1 = _mm256_unpackhi_pd(b0, b1);
+		const __m256d t2 = _mm256_unpacklo_pd(b2, b3);
+		const __m256d t3 = _mm256_unpackhi_pd(b2, b3);
+
+		const __m256d axes[3] = {
+			_mm256_mul_pd(_mm256_sub_pd(_mm256_permute2f128_pd(t0, t2, 0x20), ox), scale),
+			_mm256_mul_pd(_mm256_sub_pd(_mm256_permute2f128_pd(t1, t3, 0x20), oy), scale),
+			_mm256_mul_pd(_mm256_sub_pd(_mm256_permute2f128_pd(t0, t2, 0x31), oz), scale),
+		};
+		int32_t* q[3] = { qx, qy, qz };
+		for (unsigned a = 0; a < 3; a++)
+		{
+			const __m256d v = _mm256_round_pd(axes[a], _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			const __m256d on = _mm256_and_pd(_mm256_cmp_pd(v, zero, _CMP_GE_OQ), _mm256_cmp_pd(v, limit, _CMP_LT_OQ));
+			outside |= _mm256_movemask_pd(on) ^ 0xF;
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(q[a] + i), _mm256_cvtpd_epi32(_mm256_and_pd(v, on)));
+		}
+	}
+
+	const bool tail = QuantiseScalar(bodies + i, count - i, grid, qx + i, qy + i, qz + i);
+	return outside == 0 && tail;
+}
+
+NBODY_TARGET("avx2,fma")
+inline void DequantiseAVX2(const int32_t* qx, const int32_t* qy, const int32_t* qz, const double* masses,
+	size_t count, const QuantisedGrid& grid, Vec4* bodies)
+{
+	const __m256d step = _mm256_set1_pd(grid.step);
+	const __m256d ox = _mm256_set1_pd(grid.origin[0]);
+	const __m256d oy = _mm256_set1_pd(grid.origin[1]);
+	const __m256d oz = _mm256_set1_pd(grid.origin[2]);
+	double* out = &bodies[0].x;
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m256d x = _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(qx + i))), step, ox);
+		const __m256d y = _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(qy + i))), step, oy);
+		const __m256d z = _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(qz + i))), step, oz);
+		const __m256d w = _mm256_loadu_pd(masses + i);
+
+		const __m256d t0 = _mm256_unpacklo_pd(x, y);
+		const __m256d t1 = _mm256_unpackhi_pd(x, y);
+		const __m256d t2 = _mm256_unpacklo_pd(z, w);
+		const __m256d t3 = _mm256_unpackhi_pd(z, w);
+		_mm256_store_pd(out + 4 * i, _mm256_permute2f128_pd(t0, t2, 0x20));
+		_mm256_store_pd(out + 4 * i + 4, _mm256_permute2f128_pd(t1, t3, 0x20));
+		_mm256_store_pd(out + 4 * i + 8, _mm256_permute2f128_pd(t0, t2, 0x31));
+		_mm256_store_pd(out + 4 * i + 12, _mm256_permute2f128_pd(t1, t3, 0x31));
+	}
+
+	DequantiseScalar(qx + i, qy + i, qz + i, masses + i, count - i, grid, bodies + i);
+}
+
+#endif
+
+// The widest quantised kernels this host can run
+inline QuantiseKernel GetQuantiseKernel()
+{
+#ifdef NBODY_X86
+	if (DetectSimdIsa() != SimdIsa::Scalar)
+	{
+		return QuantiseAVX2;
+	}
+#endif
+	return QuantiseScalar;
+}
+
+inline DequantiseKernel GetDequantiseKernel()
+{
+#ifdef NBODY_X86
+	if (DetectSimdIsa() != SimdIsa::Scalar)
+	{
+		return DequantiseAVX2;
+	}
+#endif
+	return DequantiseScalar;
+}
+
+inline uint32_t ZigZag(int32_t v)
+{
+	return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+}
+
+inline int32_t UnZigZag(uint32_t v)
+{
+	return int32_t(v >> 1) ^ -int32_t(v & 1);
+}
+
+// Bit pack values, padded to whole blocks, into out. Returns the end of what was written.
+inline unsigned char* PackQuantisedBlocks(const uint32_t* values, size_t padded, unsigned char* out)
+{
+	for (size_t b = 0; b < padded; b += QUANTISED_BLOCK)
+	{
+		uint32_t any = 0;
+		for (size_t k = 0; k < QUANTISED_BLOCK; k++)
+		{
+			any |= values[b + k];
+		}
+		const unsigned width = any == 0 ? 0 : 64 - CountLeadingZeros64(any);
+		*out++ = static_cast<unsigned char>(width);
+
+		// A block is always a whole number of bytes
+		uint64_t bits = 0;
+		unsigned filled = 0;
+		for (size_t k = 0; k < QUANTISED_BLOCK; k++)
+		{
+			bits |= uint64_t(values[b + k]) << filled;
+			filled += width;
+			for (; filled >= 8; filled -= 8)
+			{
+				*out++ = static_cast<unsigned char>(bits);
+				bits >>= 8;
+			}
+		}
+	}
+	return out;
+}
+
+// Unpack what PackQuantisedBlocks() wrote. Returns nullptr if it runs past end.
+inline const unsigned char* UnpackQuantisedBlocks(const unsigned char* in, const unsigned char* end, size_t padded,
+	uint32_t* values)
+{
+	for (size_t b = 0; b < padded; b += QUANTISED_BLOCK)
+	{
+		if (in == end)
+		{
+			return nullptr;
+		}
+		const unsigned width = *in++;
+		if (width > 32 || size_t(end - in) < QUANTISED_BLOCK * width / 8)
+		{
+			return nullptr;
+		}
+
+		const uint64_t mask = (uint64_t(1) << width) - 1;
+		uint64_t bits = 0;
+		unsigned filled = 0;
+		for (size_t k = 0; k < QUANTISED_BLOCK; k++)
+		{
+			for (; filled < width; filled += 8)
+			{
+				bits |= uint64_t(*in++) << filled;
+			}
+			values[b + k] = uint32_t(bits & mask);
+			bits >>= width;
+			filled -= width;
+		}
+	}
+	return in;
+}
+
+inline size_t QuantisedPadded(size_t count)
+{
+	return (count + QUANTISED_BLOCK - 1) / QUANTISED_BLOCK * QUANTISED_BLOCK;
+}
+
+// Most bytes a frame of count bodies encodes to, slack included
+inline size_t FrameCodecBound(FrameCodec codec, size_t count)
+{
+	const size_t words = 4 * count;
+	switch (codec)
+	{
+	case FrameCodec::XorDelta:
+		return (words + 1) / 2 + words * sizeof(uint64_t) + FRAME_CODEC_SLACK;
+	case FrameCodec::Quantised:
+		return sizeof(QuantisedGrid) + count * sizeof(double)
+			+ 3 * (QuantisedPadded(count) / QUANTISED_BLOCK) * (1 + QUANTISED_BLOCK * sizeof(uint32_t)) + FRAME_CODEC_SLACK;
+	default:
+		return count * sizeof(Vec4);
+	}
+}
+
+class FrameEncoder {
+	FrameCodec codec;
+	std::vector<uint64_t> previous; //! Bits of the last frame encoded
+
+	double max_error;
+	QuantiseKernel quantise;
+	QuantisedGrid grid = {};
+	std::vector<int32_t> quantised[3]; //! This frame on the grid, one stream per axis
+	std::vector<int32_t> last[3];      //! The last frame on the grid
+	std::vector<uint32_t> changes;
+	std::vector<uint64_t> keys;        //! Morton keys of a keyframe's cells
+	std::vector<uint64_t> key_scratch;
+	std::vector<uint32_t> order;       //! A keyframe's bodies in Morton order
+	std::vector<uint32_t> order_scratch;
+	std::vector<unsigned char> sorted; //! A keyframe in the Morton layout
+
+public:
+	explicit FrameEncoder(FrameCodec codec = FrameCodec::Raw, double max_error = QUANTISED_ERROR)
+		: codec(codec)
+		, max_error(max_error)
+		, quantise(GetQuantiseKernel())
+	{
+	}
+
+	FrameCodec getCodec() const
+	{
+		return codec;
+	}
+
+	// Largest error in any coordinate of the last Quantised frame, at most the bound
+	// asked for unless the scene was too wide for the grid
+	double getMaxError() const
+	{
+		return 0.5 * grid.step;
+	}
+
+	// Encode count bodies into out, which holds FrameCodecBound() bytes. Returns the
+	// bytes used. A Quantised frame may have to be a keyframe when one wasn't asked for,
+	// keyframe says which it was.
+	size_t encode(const Vec4* bodies, size_t count, bool& keyframe, unsigned char* out)
+	{
+		if (codec == FrameCodec::Raw)
+		{
+			std::memcpy(out, bodies, count * sizeof(Vec4));
+			return count * sizeof(Vec4);
+		}
+		if (codec == FrameCodec::Quantised)
+		{
+			return encodeQuantised(bodies, count, keyframe, out);
+		}
+
+		const size_t words = 4 * count;
+		if (keyframe || previous.size() != words)
+		{
+			previous.assign(words, 0);
+		}
+
+		unsigned char* control = out;
+		unsigned char* data = out + (words + 1) / 2;
+		std::memset(control, 0, (words + 1) / 2);
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(bodies);
+		for (size_t i = 0; i < words; i++)
+		{
+			uint64_t v;
+			std::memcpy(&v, bytes + i * sizeof(uint64_t), sizeof(v));
+			const uint64_t d = v ^ previous[i];
+			previous[i] = v;
+
+			// Significant bytes, lowest first: all 8 are stored, only n are kept
+			const unsigned n = d == 0 ? 0 : 8 - CountLeadingZeros64(d) / 8;
+			control[i / 2] |= static_cast<unsigned char>(n << ((i & 1) * 4));
+			std::memcpy(data, &d, sizeof(d));
+			data += n;
+		}
+		return size_t(data - out);
+	}
+
+private:
+	size_t encodeQuantised(const Vec4* bodies, size_t count, bool& keyframe, unsigned char* out)
+	{
+		// The padding of every stream stays zero
+		const size_t padded = QuantisedPadded(count);
+		keyframe = keyframe || last[0].size() != padded
+			|| !quantise(bodies, count, grid, quantised[0].data(), quantised[1].data(), quantised[2].data());
+		if (keyframe)
+		{
+			grid = FitQuantisedGrid(bodies, count, max_error);
+			for (unsigned a = 0; a < 3; a++)
+			{
+				quantised[a].assign(padded, 0);
+				last[a].assign(padded, 0);
+			}
+			quantise(bodies, count, grid, quantised[0].data(), quantised[1].data(), quantised[2].data());
+		}
+
+		unsigned char* data = out;
+		if (keyframe)
+		{
+			data = encodeKeyframe(bodies, count, out);
+		}
+		else
+		{
+			std::memcpy(data, &grid, sizeof(grid));
+			data += sizeof(grid);
+			changes.assign(padded, 0);
+			for (unsigned a = 0; a < 3; a++)
+			{
+				const int32_t* q = quantised[a].data();
+				const int32_t* p = last[a].data();
+				for (size_t i = 0; i < count; i++)
+				{
+					changes[i] = ZigZag(q[i] - p[i]);
+				}
+				data = PackQuantisedBlocks(changes.data(), padded, data);
+			}
+		}
+
+		for (unsigned a = 0; a < 3; a++)
+		{
+			quantised[a].swap(last[a]);
+		}
+		return size_t(data - out);
+	}
+
+	// Code the keyframe in both layouts and keep the smaller. Returns the end of what was written.
+	unsigned char* encodeKeyframe(const Vec4* bodies, size_t count, unsigned char* out)
+	{
+		const size_t padded = QuantisedPadded(count);
+		changes.assign(padded, 0);
+
+		grid.layout = uint32_t(QuantisedLayout::GivenOrder);
+		unsigned char* data = out;
+		std::memcpy(data, &grid, sizeof(grid));
+		data += sizeof(grid);
+		for (size_t i = 0; i < count; i++)
+		{
+			std::memcpy(data, &bodies[i].w, sizeof(double));
+			data += sizeof(double);
+		}
+		for (unsigned a = 0; a < 3; a++)
+		{
+			// Against the body before, the first against the grid's corner
+			const int32_t* q = quantised[a].data();
+			for (size_t i = 0; i < count; i++)
+			{
+				changes[i] = ZigZag(q[i] - (i == 0 ? 0 : q[i - 1]));
+			}
+			data = PackQuantisedBlocks(changes.data(), padded, data);
+		}
+
+		// The grid is no wider than a Morton key's axis
+		keys.resize(count);
+		order.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			keys[i] = MortonEncode(uint32_t(quantised[0][i]), uint32_t(quantised[1][i]), uint32_t(quantised[2][i]));
+			order[i] = uint32_t(i);
+		}
+		MortonRadixSort(keys, order, key_scratch, order_scratch);
+
+		QuantisedGrid morton = grid;
+		morton.layout = uint32_t(QuantisedLayout::MortonOrder);
+		sorted.resize(FrameCodecBound(FrameCodec::Quantised, count));
+		unsigned char* alt = sorted.data();
+		std::memcpy(alt, &morton, sizeof(morton));
+		alt += sizeof(morton);
+		for (size_t k = 0; k < count; k++)
+		{
+			std::memcpy(alt, &bodies[order[k]].w, sizeof(double));
+			alt += sizeof(double);
+			changes[k] = ZigZag(int32_t(order[k] - (k == 0 ? 0 : order[k - 1])));
+		}
+		alt = PackQuantisedBlocks(changes.data(), padded, alt);
+
+		// Key gaps are up to 63 bits, low and high halves go in separate streams
+		for (unsigned half = 0; half < 2; half++)
+		{
+			for (size_t k = 0; k < count; k++)
+			{
+				const uint64_t gap = keys[k] - (k == 0 ? 0 : keys[k - 1]);
+				changes[k] = uint32_t(gap >> (32 * half));
+			}
+			alt = PackQuantisedBlocks(changes.data(), padded, alt);
+		}
+
+		const size_t bytes = size_t(alt - sorted.data());
+		if (bytes >= size_t(data - out))
+		{
+			return data;
+		}
+		grid = morton;
+		std::memcpy(out, sorted.data(), bytes);
+		return out + bytes;
+	}
+};
+
+class FrameDecoder {
+	FrameCodec codec;
+	std::vector<uint64_t> previous; //! Bits of the last frame decoded
+
+	DequantiseKernel dequantise;
+	std::vector<int32_t> last[3];   //! The last Quantised frame on its grid
+	std::vector<double> masses;     //! From the last keyframe
+	std::vector<uint32_t> changes;
+	std::vector<uint32_t> high;     //! High halves of a Morton layout's key gaps
+	std::vector<uint32_t> order;    //! A Morton layout's bodies in key order
+	std::vector<double> sorted;     //! Its masses in key order
+	std::vector<unsigned char> seen;
+
+public:
+	explicit FrameDecoder(FrameCodec codec = FrameCodec::Raw)
+		: codec(codec)
+		, dequantise(GetDequantiseKernel())
+	{
+	}
+
+	// Decode a frame of count bodies from the bytes at in, which must be followed by
+	// FRAME_CODEC_SLACK readable bytes. Returns false if the frame is malformed.
+	bool decode(const unsigned char* in, size_t bytes, size_t count, bool keyframe, Vec4* bodies)
+	{
+		if (codec == FrameCodec::Raw)
+		{
+			if (bytes != count * sizeof(Vec4))
+			{
+				return false;
+			}
+			std::memcpy(bodies, in, bytes);
+			return true;
+		}
+		if (codec == FrameCodec::Quantised)
+		{
+			return decodeQuantised(in, bytes, count, keyframe, bodies);
+		}
+
+		const size_t words = 4 * count;
+		if (keyframe || previous.size() != words)
+		{
+			if (!keyframe)
+			{
+				// A delta frame needs the frame before it
+				return false;
+			}
+			previous.assign(words, 0);
+		}
+
+		const unsigned char* control = in;
+		const unsigned char* data = in + (words + 1) / 2;
+		const unsigned char* end = in + bytes;
+		if (data > end)
+		{
+			return false;
+		}
+		unsigned char* out = reinterpret_cast<unsigned char*>(bodies);
+		for (size_t i = 0; i < words; i++)
+		{
+			const unsigned n = (control[i / 2] >> ((i & 1) * 4)) & 0xF;
+			if (n > 8 || size_t(end - data) < n)
+			{
+				return false;
+			}
+
+			uint64_t d;
+			std::memcpy(&d, data, sizeof(d));
+			d = n == 8 ? d : d & ((uint64_t(1) << (8 * n)) - 1);
+			data += n;
+
+			previous[i] ^= d;
+			std::memcpy(out + i * sizeof(uint64_t), &previous[i], sizeof(uint64_t));
+		}
+		return data == end;
+	}
+
+private:
+	bool decodeQuantised(const unsigned char* in, size_t bytes, size_t count, bool keyframe, Vec4* bodies)
+	{
+		const size_t padded = QuantisedPadded(count);
+		if (!keyframe && (last[0].size() != padded || masses.size() != count))
+		{
+			// A delta frame needs the frame before it
+			return false;
+		}
+
+		const unsigned char* data = in;
+		const unsigned char* end = in + bytes;
+		QuantisedGrid grid;
+		if (bytes < sizeof(grid) + (keyframe ? count * sizeof(double) : 0))
+		{
+			return false;
+		}
+		std::memcpy(&grid, data, sizeof(grid));
+		data += sizeof(grid);
+		changes.resize(padded);
+		if (keyframe)
+		{
+			masses.resize(count);
+			std::memcpy(masses.data(), data, count * sizeof(double));
+			data += count * sizeof(double);
+			for (auto& q : last)
+			{
+				q.assign(padded, 0);
+			}
+
+			if (grid.layout == uint32_t(QuantisedLayout::MortonOrder))
+			{
+				data = decodeMortonKeyframe(data, end, count);
+				if (data == nullptr)
+				{
+					return false;
+				}
+				dequantise(last[0].data(), last[1].data(), last[2].data(), masses.data(), count, grid, bodies);
+				return data == end;
+			}
+			if (grid.layout != uint32_t(QuantisedLayout::GivenOrder))
+			{
+				return false;
+			}
+		}
+
+		for (unsigned a = 0; a < 3; a++)
+		{
+			data = UnpackQuantisedBlocks(data, end, padded, changes.data());
+			if (data == nullptr)
+			{
+				return false;
+			}
+
+			int32_t* q = last[a].data();
+			if (keyframe)
+			{
+				int32_t previous_body = 0;
+				for (size_t i = 0; i < count; i++)
+				{
+					previous_body += UnZigZag(changes[i]);
+					q[i] = previous_body;
+				}
+			}
+			else
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					q[i] += UnZigZag(changes[i]);
+				}
+			}
+		}
+
+		dequantise(last[0].data(), last[1].data(), last[2].data(), masses.data(), count, grid, bodies);
+		return data == end;
+	}
+
+	// The ids, then the key gaps, after the masses in key order. Puts the masses and the
+	// grid positions back in the order given and returns the end of what was read, or
+	// nullptr if it's malformed.
+	const unsigned char* decodeMortonKeyframe(const unsigned char* data, const unsigned char* end, size_t count)
+	{
+		const size_t padded = QuantisedPadded(count);
+		order.resize(padded);
+		high.resize(padded);
+		data = UnpackQuantisedBlocks(data, end, padded, changes.data());
+		if (data == nullptr)
+		{
+			return nullptr;
+		}
+
+		// The ids must be a permutation, or bodies would be left out
+		seen.assign(count, 0);
+		for (size_t k = 0; k < count; k++)
+		{
+			order[k] = (k == 0 ? 0 : order[k - 1]) + uint32_t(UnZigZag(changes[k]));
+			if (order[k] >= count || seen[order[k]])
+			{
+				return nullptr;
+			}
+			seen[order[k]] = 1;
+		}
+
+		// The masses were read in key order
+		sorted.swap(masses);
+		masses.resize(count);
+		for (size_t k = 0; k < count; k++)
+		{
+			masses[order[k]] = sorted[k];
+		}
+
+		data = UnpackQuantisedBlocks(data, end, padded, changes.data());
+		data = data == nullptr ? nullptr : UnpackQuantisedBlocks(data, end, padded, high.data());
+		if (data == nullptr)
+		{
+			return nullptr;
+		}
+
+		uint64_t key = 0;
+		for (size_t k = 0; k < count; k++)
+		{
+			key += uint64_t(high[k]) << 32 | changes[k];
+			last[0][order[k]] = int32_t(MortonCompact(key >> 2));
+			last[1][order[k]] = int32_t(MortonCompact(key >> 1));
+			last[2][order[k]] = int32_t(MortonCompact(key));
+		}
+		return data;
+	}
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "ThreadPool.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+	Initial body distributions, positions in xyz and mass in w.
+
+	Every random number is a counter based draw: the k-th number of body i is a hash of the
+	seed, i and k (see CounterRandom), with no generator state carried from one body to the
+	next. So each body can be generated alone, on any worker and in any order, and a seed
+	gives the same bodies bit for bit whether they come from one thread or many. Given a
+	ThreadPool the generators fill the bodies in parallel.
+
+	Bodies start at rest except in the rotating disk, see GenerateInitialVelocities().
+*/
+enum class InitialConditions {
+	Uniform,    //! Uniform in the unit cube with masses uniform in [0, 1)
+	Plummer,    //! Plummer sphere of unit scale radius and unit total mass
+	Hernquist,  //! Hernquist sphere of unit scale radius and unit total mass, a cuspy galaxy
+	Disk,       //! Thin rotating disk of unit radius and unit total mass
+	Clustered,  //! Clusters within clusters in the unit cube, unit total mass
+	Coincident, //! Bodies stacked on a handful of shared positions, unit total mass
+};
+
+inline const char* InitialConditionsName(InitialConditions ic)
+{
+	switch (ic)
+	{
+	case InitialConditions::Uniform: return "uniform";
+	case InitialConditions::Plummer: return "plummer";
+	case InitialConditions::Hernquist: return "hernquist";
+	case InitialConditions::Disk: return "disk";
+	case InitialConditions::Clustered: return "clustered";
+	case InitialConditions::Coincident: return "coincident";
+	}
+	return "unknown";
+}
+
+inline bool ParseInitialConditions(const char* name, InitialConditions& res)
+{
+	for (auto ic : { InitialConditions::Uniform, InitialConditions::Plummer, InitialConditions::Hernquist,
+		InitialConditions::Disk, InitialConditions::Clustered, InitialConditions::Coincident })
+	{
+		if (std::strcmp(name, InitialConditionsName(ic)) == 0)
+		{
+			res = ic;
+			return true;
+		}
+	}
+	return false;
+}
+
+const constexpr uint64_t DEFAULT_SEED = 5489;
+const constexpr size_t GENERATE_GRAIN = 4096; //! Bodies per task when generating in parallel
+const constexpr double PI = 3.14159265358979323846;
+
+// SplitMix64's output function, a bijective 64 bit mix
+inline uint64_t SplitMix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+// The draws of one stream, a body or any other thing generated independently: the k-th
+// draw is the mix of the stream's key and k
+class CounterRandom {
+	uint64_t key;
+	uint64_t counter = 0;
+
+public:
+	CounterRandom(uint64_t seed, uint64_t stream)
+		: key(SplitMix64(SplitMix64(seed) ^ stream))
+	{
+	}
+
+	uint64_t next()
+	{
+		return SplitMix64(key ^ SplitMix64(counter++));
+	}
+
+	// In [0, 1), on the 53 bit grid
+	double uniform()
+	{
+		return double(next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// Standard normal by Box-Muller, two draws each
+	double normal()
+	{
+		const double u = 1.0 - uniform();
+		const double v = uniform();
+		return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * PI * v);
+	}
+
+	// Uniform on the unit sphere's surface, scaled by r
+	Vec4 direction(double r)
+	{
+		const double cos_theta = 2.0 * uniform() - 1.0;
+		const double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+		const double phi = 2.0 * PI * uniform();
+		return Vec4(r * sin_theta * std::cos(phi), r * sin_theta * std::sin(phi), r * cos_theta, 0.0);
+	}
+};
+
+// n bodies from body(i), in parallel over pool if there is one
+template <typename Body>
+std::vector<Vec4> GenerateBodies(size_t n, ThreadPool* pool, Body body)
+{
+	std::vector<Vec4> res(n);
+	auto fill = [&](size_t begin, size_t end, size_t)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			res[i] = body(i);
+		}
+	};
+	if (pool != nullptr)
+	{
+		pool->parallelFor(0, n, GENERATE_GRAIN, fill);
+	}
+	else
+	{
+		fill(0, n, 0);
+	}
+	return res;
+}
+
+inline std::vector<Vec4> GenerateUniform(size_t n, uint64_t seed = DEFAULT_SEED, ThreadPool* pool = nullptr)
+{
+	return GenerateBodies(n, pool, [=](size_t i)
+	{
+		CounterRandom rand(seed, i);
+		const double x = rand.uniform();
+		const double y = rand.uniform();
+		const double z = rand.uniform();
+		return Vec4(x, y, z, rand.uniform());
+	});
+}
+
+// Radii drawn from the inverse of the Plummer cumulative mass profile, truncated at
+// PLUMMER_CUTOFF scale radii so a rare draw can't stretch the tree's bounds
+inline std::vector<Vec4> GeneratePlummer(size_t n, uint64_t seed = DEFAULT_SEED, ThreadPool* pool = nullptr)
+{
+	const constexpr double PLUMMER_CUTOFF = 10.0;
+	const double max_mass = std::pow(1.0 + 1.0 / (PLUMMER_CUTOFF * PLUMMER_CUTOFF), -1.5);
+
+	return GenerateBodies(n, pool, [=](size_t i)
+	{
+		CounterRandom rand(seed, i);
+		const double mass_fraction = std::max(rand.uniform() * max_mass, 1e-12);
+		const double r = 1.0 / std::sqrt(std::pow(mass_fraction, -2.0 / 3.0) - 1.0);
+		Vec4 p = rand.direction(r);
+		p.w = 1.0 / double(n);
+		return p;
+	});
+}
+
+// As GeneratePlummer() for the Hernquist profile, M(r) = r^2 / (1 + r)^2. Its density
+// climbs as 1 / r into the centre, so the tree goes much deeper there than for a Plummer
+// core, and its halo falls off slower, so the cutoff is wider.
+inline std::vector<Vec4> GenerateHernquist(size_t n, uint64_t seed = DEFAULT_SEED, ThreadPool* pool = nullptr)
+{
+	const constexpr double HERNQUIST_CUTOFF = 100.0;
+	const double max_root = HERNQUIST_CUTOFF / (1.0 + HERNQUIST_CUTOFF);
+
+	return GenerateBodies(n, pool, [=](size_t i)
+	{
+		CounterRandom rand(seed, i);
+		const double root = std::sqrt(rand.uniform()) * max_root;
+		Vec4 p = rand.direction(root / (1.0 - root));
+		p.w = 1.0 / double(n);
+		return p;
+	});
+}
+
+const constexpr double DISK_HEIGHT = 0.02; //! Scale height of the rotating disk
+
+// Uniform over a disk of unit radius in the xy plane, with gaussian thickness. Its
+// velocities are set by GenerateInitialVelocities().
+inline std::vector<Vec4> GenerateDisk(size_t n, uint64_t seed = DEFAULT_SEED, ThreadPool* pool = nullptr)
+{
+	return GenerateBodies(n, pool, [=](size_t i)
+	{
+		CounterRandom rand(seed, i);
+		const double r = std::sqrt(rand.uniform());
+		const double phi = 2.0 * PI * rand.uniform();
+		return Vec4(r * std::cos(phi), r * std::sin(phi), DISK_HEIGHT * rand.normal(), 1.0 / double(n));
+	});
+}
+
+/*
+	Clusters within clusters, after Soneira and Peebles: each level has CLUSTER_BRANCHES
+	subclusters scattered in a cube around its centre, CLUSTER_SHRINK times its size, and
+	each body follows a random path of CLUSTER_LEVELS subclusters down from the unit
+	cube's centre, then scatters around the last. Every subcluster's offset is a draw of
+	its own stream, numbered by its path, so bodies sharing a path agree on it without
+	sharing any state. The density spans orders of magnitude, as in a cosmological volume.
+*/
+inline std::vector<Vec4> GenerateClustered(size_t n, uint64_t seed = DEFAULT_SEED, ThreadPool* pool = nullptr)
+{
+	const constexpr size_t CLUSTER_LEVELS = 6;
+	const constexpr uint64_t CLUSTER_BRANCHES = 8;
+	const constexpr double CLUSTER_SHRINK = 0.3;
+	const uint64_t cluster_seed = SplitMix64(seed ^ 0xC1u);
+
+	return GenerateBodies(n, pool, [=](size_t i)
+	{
+		CounterRandom rand(seed, i);
+		Vec4 centre(0.5, 0.5, 0.5, 0.0);
+		double size = 0.5 * CLUSTER_SHRINK;
+		uint64_t cluster = 0;
+		for (size_t level = 0; level < CLUSTER_LEVELS; level++)
+		{
+			cluster = cluster * CLUSTER_BRANCHES + 1 + rand.next() % CLUSTER_BRANCHES;
+			CounterRandom offset(cluster_seed, cluster);
+			const double x = offset.uniform();
+			const double y = offset.uniform();
+			centre += 2.0 * size * Vec4(x - 0.5, y - 0.5, offset.uniform() - 0.5, 0.0);
+			size *= CLUSTER_SHRINK;
+		}
+		// One at a time, as the order of a call's arguments is unspecified
+		const double x = centre.x + size * rand.normal();
+		const double y = centre.y + size * rand.normal();
+		return Vec4(x, y, centre.z + size * rand.normal(), 1.0 / double(n));
+	});
+}
+
+// Every body on one of COINCIDENT_SITES positions, the degenerate case for trees that
+// split until bodies are apart
+inline std::vector<Vec4> GenerateCoincident(size_t n, uint64_t seed = DEFAULT_SEED, ThreadPool* pool = nullptr)
+{
+	const constexpr size_t COINCIDENT_SITES = 8;
+	const uint64_t site_seed = SplitMix64(seed ^ 0x5173u);
+
+	return GenerateBodies(n, pool, [=](size_t i)
+	{
+		CounterRandom rand(site_seed, i % COINCIDENT_SITES);
+		const double x = rand.uniform();
+		const double y = rand.uniform();
+		return Vec4(x, y, rand.uniform(), 1.0 / double(n));
+	});
+}
+
+inline std::vector<Vec4> GenerateInitialConditions(InitialConditions ic, size_t n, uint64_t seed = DEFAULT_SEED,
+	ThreadPool* pool = nullptr)
+{
+	switch (ic)
+	{
+	case InitialConditions::Plummer: return GeneratePlummer(n, seed, pool);
+	case InitialConditions::Hernquist: return GenerateHernquist(n, seed, pool);
+	case InitialConditions::Disk: return GenerateDisk(n, seed, pool);
+	case InitialConditions::Clustered: return GenerateClustered(n, seed, pool);
+	case InitialConditions::Coincident: return GenerateCoincident(n, seed, pool);
+	default: return GenerateUniform(n, seed, pool);
+	}
+}
+
+// Starting velocities for positions from GenerateInitialConditions(ic): at rest, but for
+// the disk, which turns on near circular orbits about z. A uniform disk of unit mass holds
+// r^2 of it within r, so taken as spherical a body at r orbits at sqrt(G r).
+inline std::vector<Vec4> GenerateInitialVelocities(InitialConditions ic, const std::vector<Vec4>& positions, double G,
+	ThreadPool* pool = nullptr)
+{
+	if (ic != InitialConditions::Disk)
+	{
+		return std::vector<Vec4>(positions.size(), Vec4(0.0, 0.0, 0.0, 0.0));
+	}
+
+	return GenerateBodies(positions.size(), pool, [&](size_t i)
+	{
+		const Vec4& p = positions[i];
+		const double r = std::sqrt(p.x * p.x + p.y * p.y);
+		if (r == 0.0)
+		{
+			return Vec4(0.0, 0.0, 0.0, 0.0);
+		}
+		const double v = std::sqrt(G * r);
+		return Vec4(-v * p.y / r, v * p.x / r, 0.0, 0.0);
+	});
+}
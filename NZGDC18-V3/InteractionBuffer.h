@@ -0,0 +1,98 @@
+#pragma once
+
+#include "Quadrupole.h"
+#include "Vec4.h"
+#include <cstddef>
+
+/*
+	Fixed-capacity SoA interaction buffer filled during a tree walk.
+
+	Rather than growing a list for the whole walk, interactions are gathered into Capacity
+	aligned slots per component, and handed to consumer(x, y, z, m, count) each time the
+	buffer fills and once more at the end. Force kernels accumulate into their result, so
+	a target's force can be summed block by block, and the walk never allocates.
+
+	Positions are stored relative to origin, which the walk sets near its targets. With F
+	as float that keeps the offsets of nearby sources, the ones that dominate the force,
+	as precise as the mixed precision kernels need.
+*/
+template <size_t Capacity, typename F = double>
+struct InteractionBuffer {
+	static_assert(Capacity % 16 == 0, "Blocks should fill whole AVX-512 registers");
+
+	alignas(64) F x[Capacity];
+	alignas(64) F y[Capacity];
+	alignas(64) F z[Capacity];
+	alignas(64) F m[Capacity];
+	size_t count = 0;
+	Vec4 origin = Vec4(0.0, 0.0, 0.0, 0.0);
+
+	void reset(const Vec4& o)
+	{
+		count = 0;
+		origin = o;
+	}
+
+	template <typename Consumer>
+	void push(const Vec4& p, Consumer& consumer)
+	{
+		x[count] = static_cast<F>(p.x - origin.x);
+		y[count] = static_cast<F>(p.y - origin.y);
+		z[count] = static_cast<F>(p.z - origin.z);
+		m[count] = static_cast<F>(p.w);
+		if (++count == Capacity)
+		{
+			flush(consumer);
+		}
+	}
+
+	template <typename Consumer>
+	void flush(Consumer& consumer)
+	{
+		if (count != 0)
+		{
+			consumer(x, y, z, m, count);
+			count = 0;
+		}
+	}
+};
+
+const constexpr size_t INTERACTION_BLOCK = 256; //! Interactions handed to a kernel at once
+
+// Walk tree for source, streaming its bodies and accepted cells through buffer into
+// consumer, relative to source. Returns the number of interactions.
+template <typename Tree, typename Criterion, size_t Capacity, typename F, typename Consumer>
+size_t StreamInteractions(const Tree& tree, const Vec4& source, const Criterion& criterion,
+	typename Tree::TraversalStack& stack, InteractionBuffer<Capacity, F>& buffer, Consumer consumer)
+{
+	size_t count = 0;
+	buffer.reset(source);
+	tree.getInteractions(source, criterion, stack, [&](const Vec4& q)
+	{
+		buffer.push(q, consumer);
+		count++;
+	});
+	buffer.flush(consumer);
+	return count;
+}
+
+// As above, also passing every accepted cell to cells(com, quadrupole)
+template <typename Tree, typename Criterion, size_t Capacity, typename F, typename Consumer, typename C>
+size_t StreamInteractionsWithMoments(const Tree& tree, const Vec4& source, const Criterion& criterion,
+	typename Tree::TraversalStack& stack, InteractionBuffer<Capacity, F>& buffer, Consumer consumer, C cells)
+{
+	size_t count = 0;
+	buffer.reset(source);
+	tree.getInteractionsWithMoments(source, criterion, stack, [&](const Vec4& q)
+	{
+		buffer.push(q, consumer);
+		count++;
+	}, [&](const Vec4& com, const Quadrupole& moment)
+	{
+		buffer.push(com, consumer);
+		cells(com, moment);
+		count++;
+	});
+	buffer.flush(consumer);
+	return count;
+}
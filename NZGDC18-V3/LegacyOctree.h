@@ -0,0 +1,520 @@
+#pragma once
+
+#include "OpeningCriteria.h"
+#include "TraversalStats.h"
+#include "Vec4.h"
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+/*
+	The first two trees of the talk, kept so every later stage can be measured against
+	them in the same binary.
+
+	v1::Octree is the NZGDC18-V1 tree: recursive insert and query in single precision.
+	v2::Octree is the NZGDC18-V2 tree: the same tree in double precision, with insert and
+	query walking an explicit list threaded through each node's scratch pointer. Both are
+	copied as they were, including V1's query visiting an accepted cell once per child.
+*/
+namespace brandonpelfrey {
+namespace v1 {
+
+	using Vec4 = Vector4<float>;
+
+	class Octree {
+		// Physical position/mass.
+		Vec4 origin;         //! The physical center of this node
+
+		// The tree has up to eight children and can additionally store
+		// a point, though in many applications only, the leaves will store data.
+		std::array<Octree*, 8> children; //! Pointers to child octants
+		bool is_clean;
+
+		/*
+				Children follow a predictable pattern to make accesses simple.
+				Here, - means less than 'origin' in that dimension, + means greater than.
+				child:	0 1 2 3 4 5 6 7
+				x:      - - - - + + + +
+				y:      - - + + - - + +
+				z:      - + - + - + - +
+		 */
+
+		public:
+		using Point = Vec4;
+		static const constexpr bool CONCURRENT_QUERIES = true; //! Queries only read the tree
+
+		Octree()
+			: origin(Vec4(0.0f, 0.0f, 0.0f, 0.0f))
+			, is_clean(true) {
+				// Initially, there are no children
+				for(int i=0; i<8; ++i)
+					children[i] = nullptr;
+			}
+
+		Octree(Octree&& other)
+			: origin(other.origin), children(other.children), is_clean(other.is_clean) {
+			for (int i = 0; i < 8; ++i)
+				other.children[i] = nullptr;
+			}
+
+		~Octree() {
+			// Recursively destroy octants
+			for(int i=0; i<8; ++i)
+				delete children[i];
+		}
+
+		// Determine which octant of the tree would contain 'point'
+		int getOctantContainingPoint(const Vec4& point) const {
+			int oct = 0;
+			if(point.x >= origin.x) oct |= 4;
+			if(point.y >= origin.y) oct |= 2;
+			if(point.z >= origin.z) oct |= 1;
+			return oct;
+		}
+
+		bool isLeafNode() const {
+
+			// We are a leaf if we have no children. Since we either have none, or
+			// all eight, it is sufficient to just check the first.
+			return children[0] == nullptr;
+		}
+
+		void insert(Vec4 point) {
+			// If this node doesn't have a data point yet assigned
+			// and it is a leaf, then we're done!
+			if(isLeafNode()) {
+
+				// Are we the same point in space?
+				if (is_clean) {
+					origin = point;
+					is_clean = false;
+				} else if (point.x == origin.x && point.y == origin.y && point.z == origin.z)
+				{
+					// Accumulate the masses
+					origin.w += point.w;
+				}
+
+				else {
+					// We're at a leaf, but there's already something here
+					// We will split this node so that it has 8 child octants
+					// and then insert the old data that was here, along with
+					// this new data point
+
+					// Split the current node and create new empty trees for each
+					// child octant.
+					for(int i=0; i<8; ++i) {
+						children[i] = new Octree();
+					}
+
+					// Calculate new centre of mass
+					const Vec4 old = origin;
+					origin = CentreofMass(old, point);
+
+					// Re-insert the old point, and insert this new point
+					// (We wouldn't need to insert from the root, because we already
+					// know it's guaranteed to be in this section of the tree)
+					auto oct_origin = getOctantContainingPoint(old);
+					auto oct_point = getOctantContainingPoint(point);
+					assert(oct_point != oct_origin);
+					children[oct_origin]->insert(old);
+					children[oct_point]->insert(point);
+					UpdateCentreOfMass();
+				}
+			} else {
+				// We are at an interior node. Insert recursively into the
+				// appropriate child octant
+				int octant = getOctantContainingPoint(point);
+				children[octant]->insert(point);
+				UpdateCentreOfMass();
+			}
+		}
+
+		void getPointsInsideRadiusLeafImpl(const Vec4 & source, float radius_sqr, std::vector<Vec4> & results) const
+		{
+			const Vec4 diff = source - origin;
+			const float dist = diff.normSquared();
+			if (dist <= radius_sqr)
+			{
+				results.push_back(origin);
+			}
+		}
+
+		void getPointsInsideRaduisInnerImpl(const Vec4 & source, float radius_sqr, std::vector<Vec4> & results) const
+		{
+			// We're at an interior node of the tree. We will check to see if
+			// the query radius lies outside the octants of this node.
+			for (int i = 0; i<8; ++i) {
+				// Is the centre of mass within the radius of influence
+				const Vec4 diff = source - origin;
+				const float dist = diff.normSquared();
+				if (dist > radius_sqr)
+				{
+					// Centre of mass is outside influence. Use approximation for cluster.
+					results.push_back(origin);
+				}
+				else
+				{
+					children[i]->getPointsInsideRadiusSqr(source, radius_sqr, results);
+				}
+
+			}
+		}
+
+		void getPointsInsideRadiusSqr(const Vec4& source, float radius_sqr, std::vector<Vec4>& results) const
+		{
+			// If we're at a leaf node, just see if the current data point is inside
+			// the query bounding box
+			if (isLeafNode() && !is_clean) {
+
+				getPointsInsideRadiusLeafImpl(source, radius_sqr, results);
+
+			}
+			else {
+				getPointsInsideRaduisInnerImpl(source, radius_sqr, results);
+			}
+		}
+
+		protected:
+			static Vec4 CentreofMass(Vec4 a, Vec4 b)
+			{
+				float x_acc = 0.0;
+				float y_acc = 0.0;
+				float z_acc = 0.0;
+				float w_acc = 0.0;
+
+				x_acc += a.x * a.w;
+				y_acc += a.y * a.w;
+				z_acc += a.z * a.w;
+				w_acc += a.w;
+
+				x_acc += b.x * b.w;
+				y_acc += b.y * b.w;
+				z_acc += b.z * b.w;
+				w_acc += b.w;
+
+				return Vec4(x_acc / w_acc,
+				 y_acc / w_acc,
+				 z_acc / w_acc,
+				 w_acc);
+			}
+
+			void UpdateCentreOfMass()
+			{
+				// Centre of mass can be calculated by the
+				// sum of mass-position products over the total mass of the system
+				assert(!isLeafNode());
+				float x_acc = 0.0;
+				float y_acc = 0.0;
+				float z_acc = 0.0;
+				float w_acc = 0.0;
+
+				for (auto &c : children)
+				{
+					const Vec4 p = c->origin;
+					x_acc += p.x * p.w;
+					y_acc += p.y * p.w;
+					z_acc += p.z * p.w;
+					w_acc += p.w;
+				}
+
+				origin.x = x_acc / w_acc;
+				origin.y = y_acc / w_acc;
+				origin.z = z_acc / w_acc;
+				origin.w = w_acc;
+			}
+	};
+
+}
+
+namespace v2 {
+
+	class Octree {
+		// Physical position/mass.
+		Vec4 origin;         //! The physical center of this node
+
+		// The tree has up to eight children and can additionally store
+		// a point, though in many applications only, the leaves will store data.
+		std::array<Octree*, 8> children; //! Pointers to child octants
+		mutable Octree* scratch; //! Fixed overhead tree traversal
+		bool is_clean;
+
+		/*
+				Children follow a predictable pattern to make accesses simple.
+				Here, - means less than 'origin' in that dimension, + means greater than.
+				child:	0 1 2 3 4 5 6 7
+				x:      - - - - + + + +
+				y:      - - + + - - + +
+				z:      - + - + - + - +
+		 */
+
+		public:
+		using Point = Vec4;
+		static const constexpr bool CONCURRENT_QUERIES = false; //! Queries thread their list through the nodes
+
+		Octree()
+			: origin(Vec4(0.0, 0.0, 0.0, 0.0))
+			, scratch( nullptr )
+			, is_clean(true) {
+				// Initially, there are no children
+				for(int i=0; i<8; ++i)
+					children[i] = nullptr;
+			}
+
+		Octree(Octree&& other)
+			: origin(other.origin), children(other.children), scratch(nullptr), is_clean(other.is_clean) {
+			for (int i = 0; i < 8; ++i)
+				other.children[i] = nullptr;
+			}
+
+		~Octree() {
+			// Recursively destroy octants
+			for(int i=0; i<8; ++i)
+				delete children[i];
+		}
+
+		// Determine which octant of the tree would contain 'point'
+		int getOctantContainingPoint(const Vec4& point) const {
+			int oct = 0;
+			if(point.x >= origin.x) oct |= 4;
+			if(point.y >= origin.y) oct |= 2;
+			if(point.z >= origin.z) oct |= 1;
+			return oct;
+		}
+
+		bool isLeafNode() const {
+
+			// We are a leaf if we have no children. Since we either have none, or
+			// all eight, it is sufficient to just check the first.
+			return children[0] == nullptr;
+		}
+
+		void insert(const Vec4& point)
+		{
+			insertImpl(this, point);
+		}
+
+		static void insertImpl(Octree* root, const Vec4& point) {
+			Octree* tail = nullptr;
+
+			while (!root->isLeafNode())
+			{
+				// We are at an interior node. Insert recursively into the
+				// appropriate child octant
+				root->scratch = tail;
+				tail = root;
+
+				int octant = root->getOctantContainingPoint(point);
+				root = root->children[octant];
+			}
+
+			// Are we the same point in space?
+			if (root->is_clean) {
+				root->origin = point;
+				root->is_clean = false;
+			}
+			else if (point.x == root->origin.x && point.y == root->origin.y && point.z == root->origin.z)
+			{
+				// Accumulate the masses
+				root->origin.w += point.w;
+			}
+			else
+			{
+				// We're at a leaf, but there's already something here
+				// We will split this node so that it has 8 child octants
+				// and then insert the old data that was here, along with
+				// this new data point
+
+				// Split the current node and create new empty trees for each
+				// child octant.
+				for (int i = 0; i<8; ++i)
+				{
+					root->children[i] = new Octree();
+				}
+
+				// Calculate new centre of mass
+				const Vec4 old = root->origin;
+				root->origin = CentreofMass(old, point);
+
+				// Re-insert the old point, and insert this new point
+				// (We wouldn't need to insert from the root, because we already
+				// know it's guaranteed to be in this section of the tree)
+				auto oct_origin = root->getOctantContainingPoint(old);
+				auto oct_point = root->getOctantContainingPoint(point);
+				assert(oct_point != oct_origin);
+				root->children[oct_origin]->origin = old;
+				root->children[oct_point]->origin = point;
+			}
+
+			// Iterate through changelist and update COM
+			root->scratch = tail;
+			root = tail;
+			while (root != nullptr)
+			{
+				root->UpdateCentreOfMass();
+				root = root->scratch;
+			}
+		}
+
+		void getPointsInsideRadiusSqr(const Vec4& source, double radius_sqr, std::vector<Vec4>& results) const
+		{
+			getPointsInsideRadiusSqrImpl(this, source, radius_sqr, results);
+		}
+
+		static void getPointsInsideRadiusSqrImpl(const Octree* root, const Vec4& source, double radius_sqr, std::vector<Vec4>& results)
+		{
+			const Octree* tail = root;
+			root->scratch = nullptr;
+
+			while (root != nullptr)
+			{
+				// If we're at a leaf node, just see if the current data point is inside
+				// the query bounding box
+				if (root->is_clean)
+				{
+					// Do nothing
+				}
+				else if (root->isLeafNode())
+				{
+					const Vec4 diff = source - root->origin;
+					const double dist = diff.normSquared();
+					if (dist <= radius_sqr)
+					{
+						results.push_back(root->origin);
+					}
+				}
+				else
+				{
+					// We're at an interior node of the tree. We will check to see if
+					// the query radius lies outside the octants of this node.
+
+					// Is the centre of mass within the radius of influence
+					const Vec4 diff = source - root->origin;
+					const double dist = diff.normSquared();
+					if (dist > radius_sqr)
+					{
+						// Centre of mass is outside influence. Use approximation for cluster.
+						results.push_back(root->origin);
+					}
+					else
+					{
+						for (int i = 0; i < 8; ++i)
+						{
+							Octree* c = root->children[i];
+							c->scratch = root->scratch;
+							root->scratch = c;
+						}
+					}
+				}
+
+				tail = tail->scratch;
+				root = tail;
+			}
+		}
+
+		protected:
+			static Vec4 CentreofMass(Vec4 a, Vec4 b)
+			{
+				double x_acc = 0.0;
+				double y_acc = 0.0;
+				double z_acc = 0.0;
+				double w_acc = 0.0;
+
+				x_acc += a.x * a.w;
+				y_acc += a.y * a.w;
+				z_acc += a.z * a.w;
+				w_acc += a.w;
+
+				x_acc += b.x * b.w;
+				y_acc += b.y * b.w;
+				z_acc += b.z * b.w;
+				w_acc += b.w;
+
+				return Vec4(x_acc / w_acc,
+				 y_acc / w_acc,
+				 z_acc / w_acc,
+				 w_acc);
+			}
+
+			void UpdateCentreOfMass()
+			{
+				// Centre of mass can be calculated by the
+				// sum of mass-position products over the total mass of the system
+				assert(!isLeafNode());
+				double x_acc = 0.0;
+				double y_acc = 0.0;
+				double z_acc = 0.0;
+				double w_acc = 0.0;
+
+				for (auto &c : children)
+				{
+					const Vec4 p = c->origin;
+					x_acc += p.x * p.w;
+					y_acc += p.y * p.w;
+					z_acc += p.z * p.w;
+					w_acc += p.w;
+				}
+
+				origin.x = x_acc / w_acc;
+				origin.y = y_acc / w_acc;
+				origin.z = z_acc / w_acc;
+				origin.w = w_acc;
+			}
+	};
+
+}
+
+	/*
+		A V1 or V2 tree behind the traversal interface of the V3 trees, so ForcePass can
+		drive every stage. Each query gathers the old tree's list into the stack and then
+		streams it. The old trees only know the fixed radius test and carry no moments.
+	*/
+	template <typename Tree>
+	class LegacyOctree {
+		Tree tree;
+
+		using Point = typename Tree::Point;
+
+	public:
+		static const constexpr bool CONCURRENT_QUERIES = Tree::CONCURRENT_QUERIES;
+
+		// The historical trees gather into a list rather than walking a stack, so only their
+		// leaf interactions are counted, and nothing goes into the leaf depth histogram
+		struct alignas(64) TraversalStack {
+			std::vector<Point> results;
+			TraversalStats stats;
+		};
+
+		explicit LegacyOctree(const std::vector<Vec4>& points)
+		{
+			for (auto& p : points)
+			{
+				tree.insert(Point(p.x, p.y, p.z, p.w));
+			}
+		}
+
+		template <typename F>
+		void getInteractions(const Vec4& source, const RadiusCriterion& criterion, TraversalStack& stack, F f) const
+		{
+			stack.results.clear();
+			tree.getPointsInsideRadiusSqr(Point(source.x, source.y, source.z, source.w), criterion.radius_sqr, stack.results);
+			stack.stats.walks++;
+			stack.stats.leaf_interactions += stack.results.size();
+			for (auto& q : stack.results)
+			{
+				f(Vec4(q.x, q.y, q.z, q.w));
+			}
+		}
+
+		template <typename F, typename C>
+		void getInteractionsWithMoments(const Vec4& source, const RadiusCriterion& criterion, TraversalStack& stack, F f, C) const
+		{
+			getInteractions(source, criterion, stack, f);
+		}
+
+		void getLeafDepths(DepthHistogram&) const
+		{
+		}
+	};
+
+}
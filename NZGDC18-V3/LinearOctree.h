@@ -0,0 +1,878 @@
+#pragma once
+
+#include "Bodies.h"
+#include "Morton.h"
+#include "OpeningCriteria.h"
+#include "Quadrupole.h"
+#include "RadixTree.h"
+#include "ThreadPool.h"
+#include "TraversalStats.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/*
+	Pointer-free octree built from Morton sorted bodies.
+
+	Bodies are keyed on a 63-bit Morton grid over their bounding cube and radix sorted, so
+	every node covers a contiguous run of the sorted points. Nodes live in one flat array
+	in breadth first order: the children of a node are contiguous, always stored after
+	their parent, and only non-empty octants get a node. That lets the centre of mass be
+	aggregated bottom-up in a single reverse sweep, with no per-node allocation.
+
+	build() splits the sorted run serially. buildParallel() produces the identical node
+	array from a binary radix tree over the keys, collapsed to an octree with every step
+	spread across a thread pool.
+
+	refit() keeps the topology of the last build for bodies that have since moved. Bodies
+	that left their node's cell migrate to the deepest existing node containing them, and
+	are held there as loose points when it has no child for their octant. The points are
+	then regrouped with a counting sort and the centres of mass recomputed bottom-up. The
+	tree stays correct, it just loosens as bodies wander, so callers rebuild once it has
+	degraded enough.
+
+	Queries mirror brandonpelfrey::Octree::getInteractions so Integrate() can run on either
+	tree. getGroups() and getGroupInteractions() let runs of neighbouring sorted points share
+	a single walk instead of each repeating almost the same one. A node's cell half-width
+	follows from its depth, see getHalfWidth(). Quadrupole moments are opt-in and kept
+	beside the nodes, so trees without them stay compact.
+*/
+class LinearOctree {
+public:
+	struct Node {
+		Vec4 origin;            //! Centre of mass, w holds the total mass
+		uint32_t first_child;   //! Index of the first child in nodes
+		uint32_t child_count;   //! 0 for leaves
+		uint32_t first_point;   //! First sorted point covered by this node
+		uint32_t point_count;   //! Sorted points covered by this node
+		uint32_t loose_count;   //! Points held by the node itself, all of them for leaves
+		uint32_t depth;         //! 0 at the root
+		uint32_t parent;        //! NO_PARENT at the root
+		float bmax;             //! Furthest any body in the cell lies from origin
+	};
+
+	static const constexpr uint32_t NO_PARENT = 0xFFFFFFFFu;
+
+	using TraversalStack = ::TraversalStack<uint32_t>; //! Counts each walk, see TraversalStats.h
+
+private:
+	MortonBounds bounds;
+	std::array<double, MORTON_BITS + 1> half_widths; //! Cell half-width at each depth
+	std::vector<Node> nodes;
+	bool quadrupoles_enabled = false;
+	std::vector<Quadrupole> quadrupoles; //! Moment of each node, empty unless enabled
+	std::vector<Vec4> sorted;        //! Points in Morton order
+	std::vector<uint64_t> keys;      //! Sorted Morton keys
+	std::vector<uint32_t> indices;   //! Original index of each sorted point
+
+	// Reused between builds so a steady state rebuild doesn't allocate
+	std::vector<uint64_t> key_scratch;
+	std::vector<uint32_t> index_scratch;
+	TraversalStack scratch;
+
+	// Parallel build state
+	RadixTree radix_tree;
+	std::vector<uint32_t> unique_index;      //! Distinct key index of each sorted point
+	std::vector<uint32_t> unique_start;      //! First sorted point of each distinct key
+	std::vector<uint64_t> unique_keys;
+	std::vector<uint32_t> node_offsets;      //! First octree node emitted by each radix tree node
+	std::vector<uint32_t> owners;            //! Deepest octree node emitted for each internal radix node
+	std::vector<Node> unsorted;
+	std::vector<uint64_t> order_keys;
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> ranks;
+	std::unique_ptr<std::atomic<uint32_t>[]> arrivals;
+	size_t arrivals_capacity = 0;
+
+	// Refit state, derived lazily from the last build
+	bool refit_ready = false;
+	std::vector<uint64_t> cells;             //! Morton cell prefix of each node
+	std::vector<uint32_t> point_nodes;       //! Node holding each sorted point
+	std::vector<uint32_t> destinations;      //! Node each sorted point migrates to
+	std::vector<uint32_t> subtree_counts;
+	std::vector<uint32_t> cursors;
+	std::vector<size_t> migrations;
+	std::vector<Vec4> sorted_scratch;
+	std::vector<uint32_t> node_scratch;
+
+public:
+	void build(const std::vector<Vec4>& points)
+	{
+		const size_t n = points.size();
+		refit_ready = false;
+		bounds = MortonBounds::fromPoints(points);
+		updateHalfWidths();
+
+		keys.resize(n);
+		indices.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			keys[i] = bounds.key(points[i]);
+			indices[i] = static_cast<uint32_t>(i);
+		}
+		MortonRadixSort(keys, indices, key_scratch, index_scratch);
+
+		sorted.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			sorted[i] = points[indices[i]];
+		}
+
+		nodes.clear();
+		if (n == 0)
+		{
+			return;
+		}
+
+		Node root;
+		root.first_child = 0;
+		root.child_count = 0;
+		root.first_point = 0;
+		root.point_count = static_cast<uint32_t>(n);
+		root.loose_count = root.point_count;
+		root.depth = 0;
+		root.parent = NO_PARENT;
+		nodes.push_back(root);
+
+		// Breadth first split: appending children while walking the array keeps siblings contiguous
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			const uint32_t first = nodes[i].first_point;
+			const uint32_t last = first + nodes[i].point_count;
+			const uint32_t depth = nodes[i].depth;
+
+			// Single points, and runs of points sharing a grid cell, stay leaves
+			if (last - first == 1 || depth == MORTON_BITS || keys[first] == keys[last - 1])
+			{
+				continue;
+			}
+
+			nodes[i].first_child = static_cast<uint32_t>(nodes.size());
+			nodes[i].loose_count = 0;
+			uint32_t lo = first;
+			while (lo < last)
+			{
+				const unsigned octant = MortonOctant(keys[lo], depth);
+				const uint32_t hi = static_cast<uint32_t>(std::upper_bound(keys.begin() + lo, keys.begin() + last, octant,
+					[depth](unsigned o, uint64_t k) { return o < MortonOctant(k, depth); }) - keys.begin());
+
+				Node child;
+				child.first_child = 0;
+				child.child_count = 0;
+				child.first_point = lo;
+				child.point_count = hi - lo;
+				child.loose_count = child.point_count;
+				child.depth = depth + 1;
+				child.parent = static_cast<uint32_t>(i);
+				nodes.push_back(child);
+				lo = hi;
+			}
+			nodes[i].child_count = static_cast<uint32_t>(nodes.size()) - nodes[i].first_child;
+		}
+
+		// Children always follow their parent, so one reverse sweep aggregates bottom-up
+		quadrupoles.resize(quadrupoles_enabled ? nodes.size() : 0);
+		for (size_t i = nodes.size(); i-- > 0;)
+		{
+			updateCentreOfMass(nodes[i]);
+		}
+	}
+
+	void buildParallel(const std::vector<Vec4>& points, ThreadPool& pool)
+	{
+		const size_t n = points.size();
+		refit_ready = false;
+		bounds = MortonBounds::fromPoints(points, pool);
+		updateHalfWidths();
+
+		keys.resize(n);
+		indices.resize(n);
+		pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				keys[i] = bounds.key(points[i]);
+				indices[i] = static_cast<uint32_t>(i);
+			}
+		});
+		MortonRadixSortParallel(keys, indices, key_scratch, index_scratch, pool);
+
+		sorted.resize(n);
+		pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				sorted[i] = points[indices[i]];
+			}
+		});
+
+		nodes.clear();
+		if (n == 0)
+		{
+			return;
+		}
+
+		// Collapse runs of equal keys, they end up sharing a leaf just like in build()
+		unique_index.resize(n);
+		pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				unique_index[i] = (i == 0 || keys[i] != keys[i - 1]) ? 1 : 0;
+			}
+		});
+		const size_t m = ParallelExclusiveScan(pool, unique_index);
+
+		unique_keys.resize(m);
+		unique_start.resize(m + 1);
+		pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (i == 0 || keys[i] != keys[i - 1])
+				{
+					unique_keys[unique_index[i]] = keys[i];
+					unique_start[unique_index[i]] = static_cast<uint32_t>(i);
+				}
+			}
+		});
+		unique_start[m] = static_cast<uint32_t>(n);
+
+		radix_tree.build(unique_keys, pool);
+
+		// Radix tree nodes are numbered internal [0, m - 1) then leaves [m - 1, 2m - 1).
+		// An internal node splitting at prefix length p sits at octree depth p / 3, so the edge
+		// from its parent spans (p / 3 - parent p / 3) octree levels: single child nodes down
+		// to the node that actually splits. Internal nodes inside the same 3-bit digit as
+		// their parent collapse into it. Each leaf is one octree leaf just below its parent.
+		const size_t internal = m - 1;
+		const size_t radix_nodes = internal + m;
+		auto octreeDepth = [&](uint32_t radix_parent) -> int
+		{
+			return radix_parent == RadixTree::NO_PARENT ? -1 : int(radix_tree.prefix[radix_parent]) / 3;
+		};
+
+		node_offsets.resize(radix_nodes + 1);
+		pool.parallelFor(0, radix_nodes, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				node_offsets[k] = k < internal
+					? static_cast<uint32_t>(int(radix_tree.prefix[k]) / 3 - octreeDepth(radix_tree.parent[k]))
+					: 1;
+			}
+		});
+		node_offsets[radix_nodes] = 0;
+		const size_t total = ParallelExclusiveScan(pool, node_offsets);
+
+		owners.resize(internal);
+		pool.parallelFor(0, internal, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				uint32_t r = static_cast<uint32_t>(k);
+				while (node_offsets[r + 1] == node_offsets[r])
+				{
+					r = radix_tree.parent[r];
+				}
+				owners[k] = node_offsets[r + 1] - 1;
+			}
+		});
+
+		unsorted.resize(total);
+		order_keys.resize(total);
+		order.resize(total);
+		pool.parallelFor(0, radix_nodes, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t k = begin; k < end; k++)
+			{
+				const bool leaf = k >= internal;
+				const uint32_t radix_parent = leaf ? radix_tree.leaf_parent[k - internal] : radix_tree.parent[k];
+				const uint32_t first_key = leaf ? uint32_t(k - internal) : radix_tree.first[k];
+				const uint32_t last_key = leaf ? uint32_t(k - internal) : radix_tree.last[k];
+				const int top = octreeDepth(radix_parent) + 1;
+
+				for (uint32_t o = node_offsets[k]; o < node_offsets[k + 1]; o++)
+				{
+					Node& node = unsorted[o];
+					node.first_child = 0;
+					node.child_count = 0;
+					node.first_point = unique_start[first_key];
+					node.point_count = unique_start[last_key + 1] - node.first_point;
+					node.loose_count = node.point_count;
+					node.depth = static_cast<uint32_t>(top) + (o - node_offsets[k]);
+					node.parent = o != node_offsets[k] ? o - 1
+						: radix_parent == RadixTree::NO_PARENT ? NO_PARENT : owners[radix_parent];
+
+					order_keys[o] = (uint64_t(node.depth) << 32) | node.first_point;
+					order[o] = o;
+				}
+			}
+		});
+
+		// Sorting by (depth, first point) reproduces the breadth first layout of build():
+		// siblings become contiguous and every child lands after its parent
+		MortonRadixSortParallel(order_keys, order, key_scratch, index_scratch, pool);
+
+		ranks.resize(total);
+		nodes.resize(total);
+		pool.parallelFor(0, total, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				ranks[order[i]] = static_cast<uint32_t>(i);
+			}
+		});
+		pool.parallelFor(0, total, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				nodes[i] = unsorted[order[i]];
+				if (nodes[i].parent != NO_PARENT)
+				{
+					nodes[i].parent = ranks[nodes[i].parent];
+				}
+			}
+		});
+
+		// The first and last of each sibling run record the parent's child range
+		pool.parallelFor(1, total, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (nodes[i].parent != nodes[i - 1].parent)
+				{
+					nodes[nodes[i].parent].first_child = static_cast<uint32_t>(i);
+				}
+			}
+		});
+		pool.parallelFor(1, total, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (i + 1 == total || nodes[i].parent != nodes[i + 1].parent)
+				{
+					Node& parent = nodes[nodes[i].parent];
+					parent.child_count = static_cast<uint32_t>(i + 1) - parent.first_child;
+					parent.loose_count = 0;
+				}
+			}
+		});
+
+		updateCentresOfMass(pool);
+	}
+
+	// Refit the last build to the new positions of the same bodies, in the same order, and
+	// within the same bounds. Returns the number of bodies that migrated to another node.
+	size_t refit(const std::vector<Vec4>& points, ThreadPool& pool)
+	{
+		const size_t n = sorted.size();
+		assert(points.size() == n);
+		if (n == 0)
+		{
+			return 0;
+		}
+
+		if (!refit_ready)
+		{
+			prepareRefit(pool);
+		}
+
+		destinations.resize(n);
+		migrations.assign(pool.size(), 0);
+		pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t worker)
+		{
+			size_t moved = 0;
+			for (size_t i = begin; i < end; i++)
+			{
+				const Vec4& p = points[indices[i]];
+				const uint32_t current = point_nodes[i];
+				uint32_t node = 0;
+				if (bounds.contains(p))
+				{
+					// Climb until the cell contains the body, then sink as deep as the tree goes
+					const uint64_t key = bounds.key(p);
+					node = current;
+					while (MortonCell(key, nodes[node].depth) != cells[node])
+					{
+						node = nodes[node].parent;
+					}
+					node = findDeepest(key, node);
+				}
+				destinations[i] = node;
+				moved += node != current ? 1 : 0;
+			}
+			migrations[worker] += moved;
+		});
+
+		size_t moved = 0;
+		for (auto m : migrations)
+			moved += m;
+
+		if (moved == 0)
+		{
+			// Topology still holds, only the positions change
+			pool.parallelFor(0, n, GRAIN, [&](size_t begin, size_t end, size_t)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					sorted[i] = points[indices[i]];
+				}
+			});
+		}
+		else
+		{
+			regroup(points);
+		}
+
+		updateCentresOfMass(pool);
+		return moved;
+	}
+
+	// The bodies were moved since the build, the one at index i to slots[i]. Points the
+	// tree at their new indices, for refit() and the walks, see BodyOrder.h.
+	void renumber(const std::vector<uint32_t>& slots, ThreadPool& pool)
+	{
+		assert(slots.size() == indices.size());
+		pool.parallelFor(0, indices.size(), GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				indices[i] = slots[indices[i]];
+			}
+		});
+	}
+
+	size_t size() const
+	{
+		return sorted.size();
+	}
+
+	const std::vector<Node>& getNodes() const
+	{
+		return nodes;
+	}
+
+	const std::vector<Vec4>& getSortedPoints() const
+	{
+		return sorted;
+	}
+
+	// Original index of each point in Morton order
+	const std::vector<uint32_t>& getSortedIndices() const
+	{
+		return indices;
+	}
+
+	const MortonBounds& getBounds() const
+	{
+		return bounds;
+	}
+
+	double getHalfWidth(const Node& node) const
+	{
+		return half_widths[node.depth];
+	}
+
+	// Count the leaves holding points at each depth
+	void getLeafDepths(DepthHistogram& histogram) const
+	{
+		for (const Node& node : nodes)
+		{
+			if (node.child_count == 0 && node.point_count != 0)
+			{
+				histogram.add(node.depth);
+			}
+		}
+	}
+
+	// Also accumulate quadrupole moments, from the next build or refit on
+	void setQuadrupoles(bool enabled)
+	{
+		quadrupoles_enabled = enabled;
+	}
+
+	bool hasQuadrupoles() const
+	{
+		return !quadrupoles.empty();
+	}
+
+	const std::vector<Quadrupole>& getQuadrupoles() const
+	{
+		return quadrupoles;
+	}
+
+	template<typename F>
+	void getPointsInsideRadiusSqr(const Vec4& source, double radius_sqr, F f)
+	{
+		getInteractions(source, RadiusCriterion::fromSquared(radius_sqr), scratch, std::forward<F>(f));
+	}
+
+	template<typename F>
+	void getPointsInsideRadiusSqr(const Vec4& source, double radius_sqr, TraversalStack& stack, F f) const
+	{
+		getInteractions(source, RadiusCriterion::fromSquared(radius_sqr), stack, std::forward<F>(f));
+	}
+
+	template<typename Criterion, typename F>
+	void getInteractions(const Vec4& source, const Criterion& criterion, F f)
+	{
+		getInteractions(source, criterion, scratch, std::forward<F>(f));
+	}
+
+	// Walk the tree for source, calling f for every body and accepted cell it interacts with
+	template<typename Criterion, typename F>
+	void getInteractions(const Vec4& source, const Criterion& criterion, TraversalStack& stack, F f) const
+	{
+		auto cells = [&f](const Vec4& com, const Quadrupole&) { f(com); };
+		getInteractionsImpl(source, criterion, stack, f, cells);
+	}
+
+	// As above, but accepted cells go to cells(com, quadrupole) instead. The moment is zero
+	// when the tree has no quadrupoles.
+	template<typename Criterion, typename F, typename C>
+	void getInteractionsWithMoments(const Vec4& source, const Criterion& criterion, F f, C cells)
+	{
+		getInteractionsImpl(source, criterion, scratch, f, cells);
+	}
+
+	template<typename Criterion, typename F, typename C>
+	void getInteractionsWithMoments(const Vec4& source, const Criterion& criterion, TraversalStack& stack, F f, C cells) const
+	{
+		getInteractionsImpl(source, criterion, stack, f, cells);
+	}
+
+	// Cut the sorted points into groups of at most max_size neighbours: the largest subtrees
+	// that fit, with the points of any larger leaf or refit loose points chunked. Every
+	// point lands in exactly one group, and groups come out in Morton order.
+	void getGroups(uint32_t max_size, std::vector<PointRange>& groups, TraversalStack& stack) const
+	{
+		groups.clear();
+		if (nodes.empty())
+		{
+			return;
+		}
+
+		auto emit = [&](uint32_t first, uint32_t count)
+		{
+			for (uint32_t p = first; p < first + count; p += max_size)
+			{
+				groups.push_back({ p, std::min(max_size, first + count - p) });
+			}
+		};
+
+		stack.begin(0);
+		while (!stack.empty())
+		{
+			const Node& node = nodes[stack.pop()];
+
+			if (node.point_count <= max_size || node.child_count == 0)
+			{
+				emit(node.first_point, node.point_count);
+				continue;
+			}
+
+			emit(node.first_point, node.loose_count);
+			for (uint32_t c = node.first_child + node.child_count; c-- > node.first_child;)
+			{
+				stack.push(c);
+			}
+		}
+	}
+
+	// Walk the tree once for all the targets inside box, calling f for every body and cells
+	// for every accepted cell any of them interacts with. Each test is made at the nearest
+	// point of the box, so whatever is accepted for the box is accepted for every target.
+	template<typename Criterion, typename F, typename C>
+	void getGroupInteractions(const BoundingBox& box, const Criterion& criterion, TraversalStack& stack, F f, C cells) const
+	{
+		auto distance = [&box](const Vec4& q) { return box.distanceSqr(q); };
+		traverse(distance, criterion, stack, f, cells);
+	}
+
+private:
+	template<typename Criterion, typename F, typename C>
+	void getInteractionsImpl(const Vec4& source, const Criterion& criterion, TraversalStack& stack, F& f, C& cells) const
+	{
+		auto distance = [&source](const Vec4& q) { return (source - q).normSquared(); };
+		traverse(distance, criterion, stack, f, cells);
+	}
+
+	// distance(q) gives the squared distance the criterion tests q at
+	template<typename D, typename Criterion, typename F, typename C>
+	void traverse(const D& distance, const Criterion& criterion, TraversalStack& stack, F& f, C& cells) const
+	{
+		static const Quadrupole none;
+
+		if (nodes.empty())
+		{
+			return;
+		}
+
+		stack.begin(0);
+
+		while (!stack.empty())
+		{
+			const uint32_t index = stack.pop();
+			const Node& node = nodes[index];
+
+			if (node.point_count == 0)
+			{
+				// Emptied by a refit
+				continue;
+			}
+
+			if (node.child_count != 0)
+			{
+				if (criterion.accept(distance(node.origin), half_widths[node.depth], node.bmax))
+				{
+					// Far enough away. Use approximation for cluster.
+					stack.accepted();
+					cells(node.origin, quadrupoles.empty() ? none : quadrupoles[index]);
+					continue;
+				}
+
+				for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+				{
+					stack.push(c);
+				}
+			}
+
+			// Leaves test each of their points, like the one-point leaves of Octree. Interior
+			// nodes only hold points refit into them.
+			for (uint32_t p = node.first_point; p < node.first_point + node.loose_count; p++)
+			{
+				if (criterion.includes(distance(sorted[p])))
+				{
+					stack.interacted();
+					f(sorted[p]);
+				}
+			}
+		}
+	}
+
+	static const constexpr size_t GRAIN = 4096; //! Elements per task for the parallel passes
+
+	// Bottom-up sweep: each leaf climbs towards the root, and only the last child to
+	// arrive at a node aggregates it, so every node is computed once and after all of
+	// its children
+	void updateCentresOfMass(ThreadPool& pool)
+	{
+		const size_t total = nodes.size();
+		quadrupoles.resize(quadrupoles_enabled ? total : 0);
+		if (arrivals_capacity < total)
+		{
+			arrivals.reset(new std::atomic<uint32_t>[total]);
+			arrivals_capacity = total;
+		}
+		pool.parallelFor(0, total, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				arrivals[i].store(0, std::memory_order_relaxed);
+			}
+		});
+
+		pool.parallelFor(0, total, GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				if (nodes[i].child_count != 0)
+				{
+					continue;
+				}
+
+				updateCentreOfMass(nodes[i]);
+				uint32_t p = nodes[i].parent;
+				while (p != NO_PARENT && arrivals[p].fetch_add(1, std::memory_order_acq_rel) + 1 == nodes[p].child_count)
+				{
+					updateCentreOfMass(nodes[p]);
+					p = nodes[p].parent;
+				}
+			}
+		});
+	}
+
+	// Aggregates the node's own points, then its children
+	void updateCentreOfMass(Node& node)
+	{
+		double x_acc = 0.0;
+		double y_acc = 0.0;
+		double z_acc = 0.0;
+		double w_acc = 0.0;
+
+		for (uint32_t p = node.first_point; p < node.first_point + node.loose_count; p++)
+		{
+			const Vec4& q = sorted[p];
+			x_acc += q.x * q.w;
+			y_acc += q.y * q.w;
+			z_acc += q.z * q.w;
+			w_acc += q.w;
+		}
+
+		for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+		{
+			const Vec4& q = nodes[c].origin;
+			x_acc += q.x * q.w;
+			y_acc += q.y * q.w;
+			z_acc += q.z * q.w;
+			w_acc += q.w;
+		}
+
+		if (w_acc > 0.0)
+		{
+			node.origin = Vec4(x_acc / w_acc, y_acc / w_acc, z_acc / w_acc, w_acc);
+		}
+		else if (node.point_count > 0)
+		{
+			node.origin = Vec4(sorted[node.first_point].x, sorted[node.first_point].y, sorted[node.first_point].z, 0.0);
+		}
+		else
+		{
+			node.origin = Vec4(0.0, 0.0, 0.0, 0.0);
+		}
+
+		// Bound the spread of the bodies through the children's own bounds
+		double spread = 0.0;
+		for (uint32_t p = node.first_point; p < node.first_point + node.loose_count; p++)
+		{
+			spread = std::max(spread, std::sqrt((sorted[p] - node.origin).normSquared()));
+		}
+		for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+		{
+			if (nodes[c].point_count > 0)
+			{
+				spread = std::max(spread, std::sqrt((nodes[c].origin - node.origin).normSquared()) + double(nodes[c].bmax));
+			}
+		}
+		node.bmax = RoundUpToFloat(spread);
+
+		if (!quadrupoles.empty())
+		{
+			Quadrupole q;
+			for (uint32_t p = node.first_point; p < node.first_point + node.loose_count; p++)
+			{
+				q.add(sorted[p] - node.origin, sorted[p].w);
+			}
+			for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+			{
+				q.add(nodes[c].origin - node.origin, nodes[c].origin.w, quadrupoles[c]);
+			}
+			quadrupoles[&node - nodes.data()] = q;
+		}
+	}
+
+	void updateHalfWidths()
+	{
+		for (unsigned depth = 0; depth <= MORTON_BITS; depth++)
+		{
+			half_widths[depth] = bounds.cellHalfWidth(depth);
+		}
+	}
+
+	// Cell of every node and the node holding every point, as of the last build
+	void prepareRefit(ThreadPool& pool)
+	{
+		cells.resize(nodes.size());
+		point_nodes.resize(sorted.size());
+		pool.parallelFor(0, nodes.size(), GRAIN, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				const Node& node = nodes[i];
+				cells[i] = MortonCell(keys[node.first_point], node.depth);
+				for (uint32_t p = node.first_point; p < node.first_point + node.loose_count; p++)
+				{
+					point_nodes[p] = static_cast<uint32_t>(i);
+				}
+			}
+		});
+		refit_ready = true;
+	}
+
+	// Deepest node below node whose cell contains key
+	uint32_t findDeepest(uint64_t key, uint32_t node) const
+	{
+		while (nodes[node].child_count != 0)
+		{
+			const Node& parent = nodes[node];
+			const uint64_t cell = MortonCell(key, parent.depth + 1);
+			uint32_t next = node;
+			for (uint32_t c = parent.first_child; c < parent.first_child + parent.child_count; c++)
+			{
+				if (cells[c] == cell)
+				{
+					next = c;
+					break;
+				}
+			}
+
+			if (next == node)
+			{
+				break;
+			}
+			node = next;
+		}
+		return node;
+	}
+
+	// Counting sort of the points by destination node. Each node's range holds its own
+	// points followed by its children's ranges, and points keep their relative order.
+	void regroup(const std::vector<Vec4>& points)
+	{
+		const size_t n = sorted.size();
+		const size_t total = nodes.size();
+
+		cursors.assign(total, 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			cursors[destinations[i]]++;
+		}
+
+		subtree_counts.assign(cursors.begin(), cursors.end());
+		for (size_t i = total; i-- > 1;)
+		{
+			subtree_counts[nodes[i].parent] += subtree_counts[i];
+		}
+
+		// Parents precede children, so a forward sweep hands out ranges top-down
+		nodes[0].first_point = 0;
+		for (size_t i = 0; i < total; i++)
+		{
+			Node& node = nodes[i];
+			node.point_count = subtree_counts[i];
+			node.loose_count = cursors[i];
+			cursors[i] = node.first_point;
+
+			uint32_t next = node.first_point + node.loose_count;
+			for (uint32_t c = node.first_child; c < node.first_child + node.child_count; c++)
+			{
+				nodes[c].first_point = next;
+				next += subtree_counts[c];
+			}
+		}
+
+		sorted_scratch.resize(n);
+		index_scratch.resize(n);
+		node_scratch.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			const uint32_t node = destinations[i];
+			const uint32_t slot = cursors[node]++;
+			sorted_scratch[slot] = points[indices[i]];
+			index_scratch[slot] = indices[i];
+			node_scratch[slot] = node;
+		}
+		sorted.swap(sorted_scratch);
+		indices.swap(index_scratch);
+		point_nodes.swap(node_scratch);
+	}
+};
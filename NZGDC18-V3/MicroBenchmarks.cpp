@@ -0,0 +1,242 @@
+// MicroBenchmarks.cpp : Google Benchmark suite for the octree and force hot paths.
+//
+// Each benchmark runs over BODY_COUNTS and every InitialConditions distribution, and
+// reports items per second alongside the time per item ("time/item"), where an item is
+// one insert, query, node update, force or freed heap block. Select with the usual flags,
+// for example --benchmark_filter=Query.*distribution:5 for coincident bodies.
+
+#include "ForceKernels.h"
+#include "InitialConditions.h"
+#include "Morton.h"
+#include "Octree.h"
+#include "OpeningCriteria.h"
+#include "PerfCounters.h"
+#include "Vec4.h"
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+const constexpr int64_t BODY_COUNTS[] = { 1 << 10, 1 << 14, 1 << 17 };
+const constexpr InitialConditions DISTRIBUTIONS[] = { InitialConditions::Uniform, InitialConditions::Plummer,
+	InitialConditions::Hernquist, InitialConditions::Disk, InitialConditions::Clustered, InitialConditions::Coincident };
+const constexpr double TAU = 0.25; // Opening radius, as in NZGDC18.cpp
+const constexpr double G = 6.67408e-11;
+const constexpr size_t FORCE_PAIRS = 1024; // Force() calls per iteration
+
+/*
+	Hardware counters around each benchmark's timed loop. Open it before the loop and close
+	it with the items processed; every event the host offers is reported per item next to
+	the timings, along with IPC. Paused sections are still counted, so the per item figures
+	of the destroy benchmarks include the rebuilds.
+*/
+class CounterScope {
+	benchmark::State& state;
+	PerfCounters perf;
+	PerfSample start;
+
+public:
+	explicit CounterScope(benchmark::State& state)
+		: state(state)
+		, start(perf.read())
+	{
+	}
+
+	void close(int64_t items_per_iteration)
+	{
+		const PerfSample span = perf.read() - start;
+		state.SetItemsProcessed(state.iterations() * items_per_iteration);
+		state.counters["time/item"] = benchmark::Counter(double(items_per_iteration),
+			benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+
+		const double items = double(state.iterations()) * double(items_per_iteration);
+		for (size_t i = 0; i < PERF_EVENTS; i++)
+		{
+			if (span.valid[i] && items > 0.0)
+			{
+				state.counters[std::string(PerfEventName(PerfEvent(i))) + "/item"] = span.values[i] / items;
+			}
+		}
+		if (span.has(PerfEvent::Cycles) && span.has(PerfEvent::Instructions))
+		{
+			state.counters["ipc"] = span.ipc();
+		}
+	}
+};
+
+std::vector<Vec4> Points(const benchmark::State& state)
+{
+	const auto distribution = DISTRIBUTIONS[state.range(1)];
+	return GenerateInitialConditions(distribution, size_t(state.range(0)));
+}
+
+void Label(benchmark::State& state)
+{
+	state.SetLabel(InitialConditionsName(DISTRIBUTIONS[state.range(1)]));
+}
+
+brandonpelfrey::Octree Build(const std::vector<Vec4>& points, brandonpelfrey::OctreeArena* arena)
+{
+	const MortonBounds bounds = MortonBounds::fromPoints(points);
+	brandonpelfrey::Octree res(bounds.centre, bounds.half_width, arena);
+	for (auto& p : points)
+	{
+		res.insert(p);
+	}
+	return res;
+}
+
+// Octree::insert, building the whole tree in a warm arena
+void BM_OctreeInsert(benchmark::State& state)
+{
+	const auto points = Points(state);
+	const MortonBounds bounds = MortonBounds::fromPoints(points);
+	brandonpelfrey::OctreeArena arena;
+
+	CounterScope counters(state);
+	for (auto _ : state)
+	{
+		{
+			brandonpelfrey::Octree tree(bounds.centre, bounds.half_width, &arena);
+			for (auto& p : points)
+			{
+				tree.insert(p);
+			}
+			benchmark::DoNotOptimize(tree);
+		}
+		arena.reset();
+	}
+	counters.close(int64_t(points.size()));
+	Label(state);
+}
+
+// Octree::getPointsInsideRadiusSqr, one query per iteration cycling through the bodies
+void BM_OctreeQuery(benchmark::State& state)
+{
+	const auto points = Points(state);
+	brandonpelfrey::OctreeArena arena;
+	const auto tree = Build(points, &arena);
+	brandonpelfrey::Octree::TraversalStack stack;
+
+	size_t i = 0;
+	CounterScope counters(state);
+	for (auto _ : state)
+	{
+		Vec4 sum(0.0, 0.0, 0.0, 0.0);
+		tree.getPointsInsideRadiusSqr(points[i], TAU * TAU, stack, [&](const Vec4& q)
+		{
+			sum += q;
+		});
+		benchmark::DoNotOptimize(sum);
+		i = i + 1 == points.size() ? 0 : i + 1;
+	}
+	counters.close(1);
+	const double queries = double(state.iterations());
+	state.counters["interactions/query"] = benchmark::Counter(double(stack.stats.interactions()) / queries);
+	state.counters["nodes/query"] = benchmark::Counter(double(stack.stats.nodes_visited) / queries);
+	state.counters["max_stack_depth"] = benchmark::Counter(double(stack.stats.max_stack_depth));
+	Label(state);
+}
+
+// UpdateCentreOfMass over every node, leaves first
+void BM_UpdateCentreOfMass(benchmark::State& state)
+{
+	const auto points = Points(state);
+	brandonpelfrey::OctreeArena arena;
+	auto tree = Build(points, &arena);
+	std::vector<brandonpelfrey::Octree*> nodes;
+	const size_t updated = tree.updateCentresOfMass(nodes);
+
+	CounterScope counters(state);
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(tree.updateCentresOfMass(nodes));
+		benchmark::ClobberMemory();
+	}
+	counters.close(int64_t(updated));
+	Label(state);
+}
+
+// Force() over FORCE_PAIRS neighbouring pairs per iteration
+void BM_Force(benchmark::State& state)
+{
+	const auto points = Points(state);
+	size_t i = 0;
+
+	CounterScope counters(state);
+	for (auto _ : state)
+	{
+		Vec4 sum(0.0, 0.0, 0.0, 0.0);
+		for (size_t k = 0; k < FORCE_PAIRS; k++)
+		{
+			sum += Force(points[i], points[i + 1], float(G));
+			i = i + 2 >= points.size() ? 0 : i + 1;
+		}
+		benchmark::DoNotOptimize(sum);
+	}
+	counters.close(int64_t(FORCE_PAIRS));
+	Label(state);
+}
+
+// Destroying a heap allocated tree, one sibling block at a time
+void BM_OctreeDestroy(benchmark::State& state)
+{
+	const auto points = Points(state);
+	const size_t allocations = brandonpelfrey::OCTREE_ALLOCATIONS.load();
+	Build(points, nullptr);
+	const size_t blocks = brandonpelfrey::OCTREE_ALLOCATIONS.load() - allocations;
+
+	CounterScope counters(state);
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		{
+			auto tree = Build(points, nullptr);
+			state.ResumeTiming();
+		}
+	}
+	counters.close(int64_t(blocks));
+	Label(state);
+}
+
+// Dropping an arena allocated tree, which leaves everything to the arena's reset
+void BM_OctreeArenaReset(benchmark::State& state)
+{
+	const auto points = Points(state);
+	brandonpelfrey::OctreeArena arena;
+
+	CounterScope counters(state);
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+		{
+			auto tree = Build(points, &arena);
+			state.ResumeTiming();
+		}
+		arena.reset();
+	}
+	counters.close(int64_t(points.size()));
+	Label(state);
+}
+
+void BodyArguments(benchmark::internal::Benchmark* b)
+{
+	b->ArgNames({ "bodies", "distribution" });
+	for (int64_t n : BODY_COUNTS)
+	{
+		for (int64_t d = 0; d < int64_t(sizeof(DISTRIBUTIONS) / sizeof(DISTRIBUTIONS[0])); d++)
+		{
+			b->Args({ n, d });
+		}
+	}
+}
+
+BENCHMARK(BM_OctreeInsert)->Apply(BodyArguments)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_OctreeQuery)->Apply(BodyArguments);
+BENCHMARK(BM_UpdateCentreOfMass)->Apply(BodyArguments)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_Force)->Apply(BodyArguments);
+BENCHMARK(BM_OctreeDestroy)->Apply(BodyArguments)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_OctreeArenaReset)->Apply(BodyArguments)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
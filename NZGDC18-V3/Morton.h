@@ -0,0 +1,304 @@
+#pragma once
+
+#include "ThreadPool.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+	63-bit Morton codes: 21 bits per axis, interleaved so each 3-bit group matches the
+	octant numbering used by Octree (x -> 4, y -> 2, z -> 1).
+*/
+const constexpr unsigned MORTON_BITS = 21;
+const constexpr uint32_t MORTON_MAX = (1u << MORTON_BITS) - 1;
+
+// Spread the low 21 bits of v so there are two zero bits between each
+inline uint64_t MortonSpread(uint32_t v)
+{
+	uint64_t x = v & 0x1FFFFF;
+	x = (x | x << 32) & 0x1F00000000FFFFull;
+	x = (x | x << 16) & 0x1F0000FF0000FFull;
+	x = (x | x << 8) & 0x100F00F00F00F00Full;
+	x = (x | x << 4) & 0x10C30C30C30C30C3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+// Inverse of MortonSpread
+inline uint32_t MortonCompact(uint64_t x)
+{
+	x &= 0x1249249249249249ull;
+	x = (x ^ (x >> 2)) & 0x10C30C30C30C30C3ull;
+	x = (x ^ (x >> 4)) & 0x100F00F00F00F00Full;
+	x = (x ^ (x >> 8)) & 0x1F0000FF0000FFull;
+	x = (x ^ (x >> 16)) & 0x1F00000000FFFFull;
+	x = (x ^ (x >> 32)) & 0x1FFFFF;
+	return static_cast<uint32_t>(x);
+}
+
+inline uint64_t MortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+	return (MortonSpread(x) << 2) | (MortonSpread(y) << 1) | MortonSpread(z);
+}
+
+// Octant (0..7) of the child containing key, below a node at the given depth (0 = root)
+inline unsigned MortonOctant(uint64_t key, unsigned depth)
+{
+	return static_cast<unsigned>(key >> (3 * (MORTON_BITS - 1 - depth))) & 7;
+}
+
+// Prefix identifying the cell at the given depth (0 = root) that contains key
+inline uint64_t MortonCell(uint64_t key, unsigned depth)
+{
+	return key >> (3 * (MORTON_BITS - depth));
+}
+
+// Leading zero bits of a non-zero 64-bit value
+inline unsigned CountLeadingZeros64(uint64_t v)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, v);
+	return 63 - index;
+#else
+	return static_cast<unsigned>(__builtin_clzll(v));
+#endif
+}
+
+// Length of the common prefix of two distinct 63-bit Morton keys, in bits
+inline unsigned MortonCommonPrefix(uint64_t a, uint64_t b)
+{
+	return CountLeadingZeros64(a ^ b) - 1;
+}
+
+/*
+	Axis aligned cube the Morton grid is laid over.
+*/
+struct MortonBounds {
+	Vec4 centre;
+	double half_width;
+
+	static MortonBounds fromPoints(const std::vector<Vec4>& points)
+	{
+		Vec4 lo(0.0, 0.0, 0.0, 0.0);
+		Vec4 hi(0.0, 0.0, 0.0, 0.0);
+		extents(points, 0, points.size(), lo, hi);
+		return fromExtents(lo, hi);
+	}
+
+	// Same result as the serial overload, the per-block extents are merged exactly
+	static MortonBounds fromPoints(const std::vector<Vec4>& points, ThreadPool& pool)
+	{
+		const size_t blocks = std::max<size_t>(1, std::min(pool.size(), points.size() / 4096));
+		const size_t block_size = std::max<size_t>(1, (points.size() + blocks - 1) / blocks);
+		std::vector<Vec4> los(blocks, Vec4(0.0, 0.0, 0.0, 0.0));
+		std::vector<Vec4> his(blocks, Vec4(0.0, 0.0, 0.0, 0.0));
+
+		pool.parallelFor(0, points.size(), block_size, [&](size_t begin, size_t end, size_t)
+		{
+			extents(points, begin, end, los[begin / block_size], his[begin / block_size]);
+		});
+
+		Vec4 lo = los[0];
+		Vec4 hi = his[0];
+		for (size_t b = 1; b * block_size < points.size(); b++)
+		{
+			lo.x = std::min(lo.x, los[b].x); hi.x = std::max(hi.x, his[b].x);
+			lo.y = std::min(lo.y, los[b].y); hi.y = std::max(hi.y, his[b].y);
+			lo.z = std::min(lo.z, los[b].z); hi.z = std::max(hi.z, his[b].z);
+		}
+		return fromExtents(lo, hi);
+	}
+
+	static void extents(const std::vector<Vec4>& points, size_t begin, size_t end, Vec4& lo, Vec4& hi)
+	{
+		if (begin < end)
+		{
+			lo = points[begin];
+			hi = points[begin];
+		}
+
+		for (size_t i = begin; i < end; i++)
+		{
+			const Vec4& p = points[i];
+			lo.x = std::min(lo.x, p.x); hi.x = std::max(hi.x, p.x);
+			lo.y = std::min(lo.y, p.y); hi.y = std::max(hi.y, p.y);
+			lo.z = std::min(lo.z, p.z); hi.z = std::max(hi.z, p.z);
+		}
+	}
+
+	static MortonBounds fromExtents(const Vec4& lo, const Vec4& hi)
+	{
+		MortonBounds res;
+		res.centre = Vec4((lo.x + hi.x) * 0.5, (lo.y + hi.y) * 0.5, (lo.z + hi.z) * 0.5, 0.0);
+		const double extent = (hi - lo).maxComponent();
+		// Pad slightly so the maximum coordinate still quantises inside the grid
+		res.half_width = extent > 0.0 ? extent * 0.5 * (1.0 + 1e-9) : 1.0;
+		return res;
+	}
+
+	uint32_t quantise(double v, double centre_v) const
+	{
+		const double scale = double(MORTON_MAX + 1) / (2.0 * half_width);
+		const double q = (v - (centre_v - half_width)) * scale;
+		if (q <= 0.0)
+			return 0;
+		if (q >= double(MORTON_MAX))
+			return MORTON_MAX;
+		return static_cast<uint32_t>(q);
+	}
+
+	uint64_t key(const Vec4& p) const
+	{
+		return MortonEncode(quantise(p.x, centre.x), quantise(p.y, centre.y), quantise(p.z, centre.z));
+	}
+
+	// Points outside the cube still get a key, clamped onto its faces
+	bool contains(const Vec4& p) const
+	{
+		return p.x >= centre.x - half_width && p.x <= centre.x + half_width
+			&& p.y >= centre.y - half_width && p.y <= centre.y + half_width
+			&& p.z >= centre.z - half_width && p.z <= centre.z + half_width;
+	}
+
+	// Centre of the cell at the given depth (0 = root) containing key
+	Vec4 cellCentre(uint64_t key, unsigned depth) const
+	{
+		const unsigned shift = 3 * (MORTON_BITS - depth);
+		const uint64_t prefix = depth == 0 ? 0 : (key >> shift) << shift;
+		const double cell = (2.0 * half_width) / double(uint64_t(1) << depth);
+		const double cx = double(MortonCompact(prefix >> 2) >> (MORTON_BITS - depth)) + 0.5;
+		const double cy = double(MortonCompact(prefix >> 1) >> (MORTON_BITS - depth)) + 0.5;
+		const double cz = double(MortonCompact(prefix) >> (MORTON_BITS - depth)) + 0.5;
+		return Vec4(centre.x - half_width + cx * cell,
+			centre.y - half_width + cy * cell,
+			centre.z - half_width + cz * cell,
+			0.0);
+	}
+
+	double cellHalfWidth(unsigned depth) const
+	{
+		return half_width / double(uint64_t(1) << depth);
+	}
+};
+
+/*
+	LSD radix sort of (key, index) pairs, 8 bits per pass. Passes where every key shares
+	the same digit are skipped. 'keys' and 'indices' are sorted in place, the scratch
+	vectors are resized as needed and can be reused between calls.
+*/
+inline void MortonRadixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& indices,
+	std::vector<uint64_t>& key_scratch, std::vector<uint32_t>& index_scratch)
+{
+	const size_t n = keys.size();
+	key_scratch.resize(n);
+	index_scratch.resize(n);
+
+	for (unsigned shift = 0; shift < 3 * MORTON_BITS; shift += 8)
+	{
+		size_t counts[256] = {};
+		for (size_t i = 0; i < n; i++)
+		{
+			counts[(keys[i] >> shift) & 0xFF]++;
+		}
+
+		if (n == 0 || counts[(keys[0] >> shift) & 0xFF] == n)
+		{
+			continue;
+		}
+
+		size_t offset = 0;
+		for (auto& c : counts)
+		{
+			const size_t t = c;
+			c = offset;
+			offset += t;
+		}
+
+		for (size_t i = 0; i < n; i++)
+		{
+			const size_t dst = counts[(keys[i] >> shift) & 0xFF]++;
+			key_scratch[dst] = keys[i];
+			index_scratch[dst] = indices[i];
+		}
+
+		keys.swap(key_scratch);
+		indices.swap(index_scratch);
+	}
+}
+
+/*
+	Parallel variant of MortonRadixSort. Each pass splits the keys into one block per
+	worker, histograms the blocks concurrently, then scatters them concurrently into
+	disjoint, precomputed output ranges. The result is identical to the serial sort.
+*/
+inline void MortonRadixSortParallel(std::vector<uint64_t>& keys, std::vector<uint32_t>& indices,
+	std::vector<uint64_t>& key_scratch, std::vector<uint32_t>& index_scratch, ThreadPool& pool)
+{
+	const size_t n = keys.size();
+	const size_t blocks = std::max<size_t>(1, std::min(pool.size(), n / 4096));
+	if (blocks == 1)
+	{
+		MortonRadixSort(keys, indices, key_scratch, index_scratch);
+		return;
+	}
+
+	key_scratch.resize(n);
+	index_scratch.resize(n);
+	const size_t block_size = (n + blocks - 1) / blocks;
+	std::vector<size_t> counts(blocks * 256);
+
+	for (unsigned shift = 0; shift < 3 * MORTON_BITS; shift += 8)
+	{
+		std::fill(counts.begin(), counts.end(), 0);
+		pool.parallelFor(0, n, block_size, [&](size_t begin, size_t end, size_t)
+		{
+			size_t* c = &counts[(begin / block_size) * 256];
+			for (size_t i = begin; i < end; i++)
+			{
+				c[(keys[i] >> shift) & 0xFF]++;
+			}
+		});
+
+		// Digit major, block minor offsets keep the sort stable
+		size_t offset = 0;
+		bool constant = false;
+		for (size_t d = 0; d < 256; d++)
+		{
+			size_t digit_total = 0;
+			for (size_t b = 0; b < blocks; b++)
+			{
+				const size_t t = counts[b * 256 + d];
+				counts[b * 256 + d] = offset;
+				offset += t;
+				digit_total += t;
+			}
+			constant |= digit_total == n;
+		}
+
+		if (constant)
+		{
+			continue;
+		}
+
+		pool.parallelFor(0, n, block_size, [&](size_t begin, size_t end, size_t)
+		{
+			size_t* c = &counts[(begin / block_size) * 256];
+			for (size_t i = begin; i < end; i++)
+			{
+				const size_t dst = c[(keys[i] >> shift) & 0xFF]++;
+				key_scratch[dst] = keys[i];
+				index_scratch[dst] = indices[i];
+			}
+		});
+
+		keys.swap(key_scratch);
+		indices.swap(index_scratch);
+	}
+}
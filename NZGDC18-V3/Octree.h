@@ -2,32 +2,60 @@
 
 #include "stdafx.h"
 
+#include "OpeningCriteria.h"
+#include "Quadrupole.h"
+#include "TraversalStats.h"
 #include "Vec4.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <utility>
 #include <vector>
 
 namespace brandonpelfrey {
 
+	class OctreeArena;
+
+	// Heap allocations and frees made for octree nodes, by the heap path and arena growth alike
+	inline std::atomic<size_t> OCTREE_ALLOCATIONS(0);
+	inline std::atomic<size_t> OCTREE_FREES(0);
+
 	/**!
 	 *
 	 */
 	class Octree {
 		// Physical position/mass.
 		Vec4 origin;         //! The physical center of this node
-	
-
-		// The tree has up to eight children and can additionally store
-		// a point, though in many applications only, the leaves will store data.
-		std::array<Octree*, 8> children; //! Pointers to child octants
+		Vec4 centre;         //! Geometric centre of the cell, w holds its half-width
+
+		// Quadrupole moments are opt-in, see setQuadrupoles(). Each block of siblings has
+		// a block of moments alongside, so trees without them keep nodes small and skip
+		// accumulating them.
+		Quadrupole* quadrupole; //! Moment about origin, nullptr without quadrupoles
+
+		// Interior nodes only keep the octants that hold bodies. Siblings are allocated
+		// together in octant order, so one pointer and the mask reach all of them.
+		Octree* children; //! First of the occupied child octants
+		Vec4* bodies;     //! Bodies held by a leaf, contiguous
+		OctreeArena* arena; //! Owner of this node's children and bodies, nullptr for the heap
 		mutable Octree* scratch; //! Fixed overhead tree traversal
+		uint32_t body_count;
+		uint32_t body_capacity;
+		uint32_t bucket_size; //! Bodies a leaf holds before it splits
+		float bmax; //! Furthest any body in the cell lies from origin
+		uint8_t child_mask; //! Bit i set when octant i has a child
 		bool is_clean;
 
 		/*
 				Children follow a predictable pattern to make accesses simple.
-				Here, - means less than 'origin' in that dimension, + means greater than.
+				Here, - means less than 'centre' in that dimension, + means greater than.
 				child:	0 1 2 3 4 5 6 7
 				x:      - - - - + + + +
 				y:      - - + + - - + +
@@ -35,41 +63,136 @@ namespace brandonpelfrey {
 		 */
 
 		public:
-		Octree() 
+		// Cells are split geometrically about their centre. Leaves this deep stop splitting
+		// and just grow, so inputs far outside the root cell can't split forever.
+		static const constexpr unsigned MAX_DEPTH = 64;
+
+		// Default bodies per leaf. 1 is the classic one body per leaf tree.
+		static const constexpr uint32_t BUCKET_SIZE = 1;
+
+		// Nodes built with an arena take their descendants from it, and leave freeing them
+		// to the arena's reset. Otherwise each block of siblings is a single heap allocation.
+		explicit Octree(OctreeArena* arena = nullptr, uint32_t bucket_size = BUCKET_SIZE)
+			: Octree(Vec4(0.0, 0.0, 0.0, 0.0), 1.0, arena, bucket_size)
+		{
+		}
+
+		Octree(const Vec4& centre, double half_width, OctreeArena* arena = nullptr, uint32_t bucket_size = BUCKET_SIZE)
 			: origin(Vec4(0.0, 0.0, 0.0, 0.0))
+			, centre(Vec4(centre.x, centre.y, centre.z, half_width))
+			, quadrupole(nullptr)
+			, children(nullptr)
+			, bodies(nullptr)
+			, arena(arena)
 			, scratch( nullptr )
+			, body_count(0)
+			, body_capacity(0)
+			, bucket_size(std::max<uint32_t>(bucket_size, 1))
+			, bmax(0.0f)
+			, child_mask(0)
 		, is_clean(true){
-				// Initially, there are no children
-				for(int i=0; i<8; ++i) 
-					children[i] = nullptr;
 			}
 
 		Octree(Octree&& other)
-			: origin(other.origin), children(other.children) {
-			for (int i = 0; i < 8; ++i)
-				other.children[i] = nullptr;
+			: origin(other.origin)
+			, centre(other.centre)
+			, quadrupole(other.quadrupole)
+			, children(other.children)
+			, bodies(other.bodies)
+			, arena(other.arena)
+			, scratch(nullptr)
+			, body_count(other.body_count)
+			, body_capacity(other.body_capacity)
+			, bucket_size(other.bucket_size)
+			, bmax(other.bmax)
+			, child_mask(other.child_mask)
+			, is_clean(other.is_clean) {
+			other.quadrupole = nullptr;
+			other.children = nullptr;
+			other.bodies = nullptr;
+			other.child_mask = 0;
 			}
 
 		~Octree() {
-			// Recursively destroy octants
-			for(int i=0; i<8; ++i) 
-				delete children[i];
+			if (arena != nullptr)
+				return;
+
+			releaseMoments(quadrupole);
+			releaseBodies(bodies);
+			if (children == nullptr)
+				return;
+
+			// Free sibling blocks with an explicit list rather than recursing, so deep
+			// trees over clustered inputs can't overflow the stack
+			std::vector<std::pair<Octree*, unsigned>> blocks(1, std::make_pair(children, childCount()));
+			while (!blocks.empty())
+			{
+				const auto block = blocks.back();
+				blocks.pop_back();
+				for (unsigned i = 0; i < block.second; ++i)
+				{
+					Octree& child = block.first[i];
+					if (child.children != nullptr)
+					{
+						blocks.push_back(std::make_pair(child.children, child.childCount()));
+						child.children = nullptr;
+					}
+					releaseBodies(child.bodies);
+					child.bodies = nullptr;
+				}
+				releaseMoments(block.first[0].quadrupole);
+				FreeSiblings(block.first, block.second);
+			}
 		}
 
 		// Determine which octant of the tree would contain 'point'
 		int getOctantContainingPoint(const Vec4& point) const {
 			int oct = 0;
-			if(point.x >= origin.x) oct |= 4;
-			if(point.y >= origin.y) oct |= 2;
-			if(point.z >= origin.z) oct |= 1;
+			if(point.x >= centre.x) oct |= 4;
+			if(point.y >= centre.y) oct |= 2;
+			if(point.z >= centre.z) oct |= 1;
 			return oct;
 		}
 
 		bool isLeafNode() const {
 
-			// We are a leaf if we have no children. Since we either have none, or 
-			// all eight, it is sufficient to just check the first.
-			return children[0] == nullptr;
+			// We are a leaf if we have no children
+			return children == nullptr;
+		}
+
+		unsigned childCount() const {
+			return CountBits(child_mask);
+		}
+
+		uint32_t getBucketSize() const {
+			return bucket_size;
+		}
+
+		// Also accumulate quadrupole moments, for a tree with no bodies inserted yet
+		void setQuadrupoles(bool enabled)
+		{
+			assert(isLeafNode() && body_count == 0);
+			if (enabled && quadrupole == nullptr)
+			{
+				quadrupole = new (allocateMoments(1)) Quadrupole();
+			}
+			else if (!enabled)
+			{
+				releaseMoments(quadrupole);
+				quadrupole = nullptr;
+			}
+		}
+
+		bool hasQuadrupoles() const
+		{
+			return quadrupole != nullptr;
+		}
+
+		// Moment about the centre of mass, zero when the tree has no quadrupoles
+		const Quadrupole& getQuadrupole() const
+		{
+			static const Quadrupole none;
+			return quadrupole != nullptr ? *quadrupole : none;
 		}
 
 		void insert(const Vec4& point)
@@ -79,59 +202,35 @@ namespace brandonpelfrey {
 
 		static void insertImpl(Octree* root, const Vec4& point) {
 			Octree* tail = nullptr;
-			
-			while (!root->isLeafNode())
-			{
-				// We are at an interior node. Insert recursively into the 
-				// appropriate child octant
-				root->scratch = tail;
-				tail = root;
-
-				int octant = root->getOctantContainingPoint(point);
-				root = root->children[octant];
-			}
+			unsigned depth = 0;
 
-		
-			// Are we the same point in space?
-			if (root->is_clean) {
-				root->origin = point;
-				root->is_clean = false;
-			}
-			else if (point.x == root->origin.x && point.y == root->origin.y && point.z == root->origin.z)
+			for (;;)
 			{
-				// Accumulate the masses
-				root->origin.w += point.w;
-			}
-			else 
-			{
-				// We're at a leaf, but there's already something here
-				// We will split this node so that it has 8 child octants
-				// and then insert the old data that was here, along with 
-				// this new data point
-
-				// Split the current node and create new empty trees for each
-				// child octant.
-				for (int i = 0; i<8; ++i) 
+				while (!root->isLeafNode())
 				{
-					root->children[i] = new Octree();
+					// We are at an interior node. Insert recursively into the
+					// appropriate child octant, creating it if this is its first body
+					root->scratch = tail;
+					tail = root;
+
+					root = root->getChild(root->getOctantContainingPoint(point));
+					depth++;
 				}
 
-				// Calculate new centre of mass
-				const Vec4 old = root->origin;
-				root->origin = CentreofMass(old, point);
+				if (root->addBody(point, depth == MAX_DEPTH))
+				{
+					break;
+				}
 
-				// Re-insert the old point, and insert this new point
-				// (We wouldn't need to insert from the root, because we already
-				// know it's guaranteed to be in this section of the tree)
-				auto oct_origin = root->getOctantContainingPoint(old);
-				auto oct_point = root->getOctantContainingPoint(point);
-				assert(oct_point != oct_origin);
-				root->children[oct_origin]->origin = old;
-				root->children[oct_point]->origin = point;
+				// We're at a full leaf. We will split this node, hand its bodies
+				// down to the octants they fall in and carry on inserting the new
+				// one from here. All of them may share an octant, in which case
+				// that child is split in turn.
+				root->split(point);
 			}
 
 			// Iterate through changelist and update COM
-			root->scratch = tail;
+			root->UpdateCentreOfMass();
 			root = tail;
 			while (root != nullptr)
 			{
@@ -140,102 +239,425 @@ namespace brandonpelfrey {
 			}
 		}
 
+		// Recompute every centre of mass, bound and moment from the leaves up, as insert
+		// does along its path. nodes is scratch for the walk. Returns the nodes updated.
+		size_t updateCentresOfMass(std::vector<Octree*>& nodes)
+		{
+			// Parents come before their children, so the reverse visits children first
+			nodes.clear();
+			nodes.push_back(this);
+			for (size_t i = 0; i < nodes.size(); ++i)
+			{
+				Octree* node = nodes[i];
+				for (unsigned j = 0, n = node->childCount(); j < n; ++j)
+				{
+					nodes.push_back(&node->children[j]);
+				}
+			}
+
+			size_t updated = 0;
+			for (size_t i = nodes.size(); i-- > 0;)
+			{
+				if (!nodes[i]->is_clean)
+				{
+					nodes[i]->UpdateCentreOfMass();
+					updated++;
+				}
+			}
+			return updated;
+		}
+
+		// Count the leaves holding bodies at each depth
+		void getLeafDepths(DepthHistogram& histogram) const
+		{
+			std::vector<std::pair<const Octree*, unsigned>> nodes(1, std::make_pair(this, 0u));
+			while (!nodes.empty())
+			{
+				const auto node = nodes.back();
+				nodes.pop_back();
+				if (node.first->isLeafNode())
+				{
+					if (node.first->body_count != 0)
+					{
+						histogram.add(node.second);
+					}
+					continue;
+				}
+				for (unsigned i = 0, n = node.first->childCount(); i < n; ++i)
+				{
+					nodes.push_back(std::make_pair(&node.first->children[i], node.second + 1));
+				}
+			}
+		}
+
 		template<typename F>
 		void getPointsInsideRadiusSqr(const Vec4& source, double radius_sqr, F f)
 		{
-			getPointsInsideRadiusSqrImpl(this, source, radius_sqr, std::forward<F>(f));
+			getInteractions(source, RadiusCriterion::fromSquared(radius_sqr), std::forward<F>(f));
 		}
 
-		template<typename F>
-		static void getPointsInsideRadiusSqrImpl(Octree* root, const Vec4& source, double radius_sqr, F f)
+		// Walk the tree for source, calling f for every body and accepted cell it interacts with
+		template<typename Criterion, typename F>
+		void getInteractions(const Vec4& source, const Criterion& criterion, F f)
+		{
+			auto cells = [&f](const Vec4& com, const Quadrupole&) { f(com); };
+			getInteractionsImpl(this, source, criterion, f, cells);
+		}
+
+		// As above, but accepted cells go to cells(com, quadrupole) instead
+		template<typename Criterion, typename F, typename C>
+		void getInteractionsWithMoments(const Vec4& source, const Criterion& criterion, F f, C cells)
+		{
+			getInteractionsImpl(this, source, criterion, f, cells);
+		}
+
+		template<typename Criterion, typename F, typename C>
+		static void getInteractionsImpl(Octree* root, const Vec4& source, const Criterion& criterion, F& f, C& cells)
 		{
 			Octree* tail = root;
 			root->scratch = nullptr;
 
 			while (root != nullptr)
 			{
-				// If we're at a leaf node, just see if the current data point is inside
-				// the query bounding box
 				if (root->is_clean)
 				{
 					// Do nothing
 				}
 				else if (root->isLeafNode())
 				{
-					const Vec4 diff = source - root->origin;
-					const double dist = diff.normSquared();
-					if (dist <= radius_sqr)
-					{
-						f(root->origin);
-					}
+					root->visitLeaf(source, criterion, f, cells);
 				}
-				else 
+				else
 				{
 					// We're at an interior node of the tree. We will check to see if
-					// the query radius lies outside the octants of this node.
-					
-					// Is the centre of mass within the radius of influence
+					// the cell is far enough away to stand in for its bodies.
 					const Vec4 diff = source - root->origin;
 					const double dist = diff.normSquared();
-					if (dist > radius_sqr)
+					if (criterion.accept(dist, root->centre.w, root->bmax))
 					{
-						// Centre of mass is outside influence. Use approximation for cluster. 
-						f(root->origin);
+						// Far enough away. Use approximation for cluster.
+						cells(root->origin, root->getQuadrupole());
 					}
 					else
 					{
-						for (int i = 0; i < 8; ++i)
+						for (unsigned i = 0, n = root->childCount(); i < n; ++i)
 						{
-							Octree* c = root->children[i];
+							Octree* c = &root->children[i];
 							c->scratch = root->scratch;
 							root->scratch = c;
 						}
 					}
 				}
 
-				
+
 				tail = tail->scratch;
 				root = tail;
 			}
 		}
 
+		// Explicit traversal stack owned by the caller. Unlike the scratch pointers threaded
+		// through the nodes, each thread can hold its own so concurrent queries don't collide.
+		// It also counts the walk, see TraversalStats.h.
+		using TraversalStack = ::TraversalStack<const Octree*>;
+
+		template<typename F>
+		void getPointsInsideRadiusSqr(const Vec4& source, double radius_sqr, TraversalStack& stack, F f) const
+		{
+			getInteractions(source, RadiusCriterion::fromSquared(radius_sqr), stack, std::forward<F>(f));
+		}
+
+		template<typename Criterion, typename F>
+		void getInteractions(const Vec4& source, const Criterion& criterion, TraversalStack& stack, F f) const
+		{
+			auto cells = [&f](const Vec4& com, const Quadrupole&) { f(com); };
+			getInteractionsImpl(this, source, criterion, stack, f, cells);
+		}
+
+		template<typename Criterion, typename F, typename C>
+		void getInteractionsWithMoments(const Vec4& source, const Criterion& criterion, TraversalStack& stack, F f, C cells) const
+		{
+			getInteractionsImpl(this, source, criterion, stack, f, cells);
+		}
+
+		template<typename Criterion, typename F, typename C>
+		static void getInteractionsImpl(const Octree* root, const Vec4& source, const Criterion& criterion, TraversalStack& stack, F& f, C& cells)
+		{
+			// Visits nodes in the same order as the scratch list above (children pushed in
+			// octant order, popped in reverse) so results are bit-identical to the single
+			// threaded path
+			auto body = [&stack, &f](const Vec4& q) { stack.interacted(); f(q); };
+			auto cell = [&stack, &cells](const Vec4& com, const Quadrupole& q) { stack.accepted(); cells(com, q); };
+			stack.begin(root);
+
+			while (!stack.empty())
+			{
+				root = stack.pop();
+
+				if (root->is_clean)
+				{
+					// Do nothing
+				}
+				else if (root->isLeafNode())
+				{
+					root->visitLeaf(source, criterion, body, cell);
+				}
+				else
+				{
+					const Vec4 diff = source - root->origin;
+					const double dist = diff.normSquared();
+					if (criterion.accept(dist, root->centre.w, root->bmax))
+					{
+						// Far enough away. Use approximation for cluster.
+						cell(root->origin, root->getQuadrupole());
+					}
+					else
+					{
+						for (unsigned i = 0, n = root->childCount(); i < n; ++i)
+						{
+							stack.push(&root->children[i]);
+						}
+					}
+				}
+			}
+		}
+
 		protected:
-			static Vec4 CentreofMass(Vec4 a, Vec4 b)
+			Octree* allocateSiblings(unsigned count);
+			Vec4* allocateBodies(uint32_t count);
+			void releaseBodies(Vec4* block);
+			Quadrupole* allocateMoments(unsigned count);
+			void releaseMoments(Quadrupole* block);
+
+			// Give a block of siblings a fresh block of moments, carrying over those any of
+			// them already have. Their old block is left to the caller.
+			void attachMoments(Octree* block, unsigned count)
 			{
-				double x_acc = 0.0;
-				double y_acc = 0.0;
-				double z_acc = 0.0;
-				double w_acc = 0.0;
+				Quadrupole* moments = allocateMoments(count);
+				for (unsigned i = 0; i < count; ++i)
+				{
+					new (&moments[i]) Quadrupole(block[i].getQuadrupole());
+					block[i].quadrupole = &moments[i];
+				}
+			}
+			static void FreeSiblings(Octree* block, unsigned count);
+
+			static unsigned CountBits(unsigned mask)
+			{
+				unsigned res = 0;
+				for (; mask != 0; mask &= mask - 1)
+					res++;
+				return res;
+			}
+
+			// A leaf holding several bodies is tried as a cell first, like interior nodes.
+			// Otherwise, or when it's too close, each body is checked on its own.
+			template<typename Criterion, typename F, typename C>
+			void visitLeaf(const Vec4& source, const Criterion& criterion, F& f, C& cells) const
+			{
+				if (body_count > 1)
+				{
+					const Vec4 diff = source - origin;
+					if (criterion.accept(diff.normSquared(), centre.w, bmax))
+					{
+						cells(origin, getQuadrupole());
+						return;
+					}
+				}
+
+				for (uint32_t i = 0; i < body_count; ++i)
+				{
+					const Vec4 diff = source - bodies[i];
+					const double dist = diff.normSquared();
+					if (criterion.includes(dist))
+					{
+						f(bodies[i]);
+					}
+				}
+			}
+
+			// Centre of octant's cell, its half-width in w
+			Vec4 octantCentre(int octant) const
+			{
+				const double half = centre.w * 0.5;
+				return Vec4(centre.x + (octant & 4 ? half : -half),
+					centre.y + (octant & 2 ? half : -half),
+					centre.z + (octant & 1 ? half : -half),
+					half);
+			}
+
+			// Child for octant, created empty if the octant had none. Adding a child moves
+			// the block of siblings, so pointers to them don't survive it. Only inserts into
+			// a new octant of an interior node come here, split() sizes its block at once.
+			Octree* getChild(int octant)
+			{
+				const uint8_t bit = uint8_t(1u << octant);
+				const unsigned index = CountBits(child_mask & (bit - 1u));
+				if (child_mask & bit)
+				{
+					return &children[index];
+				}
+
+				const unsigned count = childCount();
+				Quadrupole* moments = count != 0 ? children[0].quadrupole : nullptr;
+				Octree* block = allocateSiblings(count + 1);
+				for (unsigned i = 0, j = 0; i <= count; ++i)
+				{
+					if (i == index)
+					{
+						const Vec4 cell = octantCentre(octant);
+						new (&block[i]) Octree(cell, cell.w, arena, bucket_size);
+					}
+					else
+					{
+						new (&block[i]) Octree(std::move(children[j++]));
+					}
+				}
+
+				if (quadrupole != nullptr)
+				{
+					attachMoments(block, count + 1);
+					releaseMoments(moments);
+				}
+				if (children != nullptr)
+				{
+					FreeSiblings(children, count);
+				}
+				children = block;
+				child_mask |= bit;
+				return &children[index];
+			}
+
+			// Add point to this leaf's bodies, merging it into a coincident body. Returns
+			// false when the bucket is full, unless it may grow anyway.
+			bool addBody(const Vec4& point, bool grow)
+			{
+				for (uint32_t i = 0; i < body_count; ++i)
+				{
+					if (point.x == bodies[i].x && point.y == bodies[i].y && point.z == bodies[i].z)
+					{
+						// Accumulate the masses
+						bodies[i].w += point.w;
+						return true;
+					}
+				}
+
+				if (body_count == bucket_size && !grow)
+				{
+					return false;
+				}
+
+				if (body_count == body_capacity)
+				{
+					// Buckets grow by doubling up to their size, so a leaf with few bodies stays small
+					const uint32_t capacity = body_capacity == 0 ? 1
+						: body_count < bucket_size ? std::min(body_capacity * 2, bucket_size) : body_capacity * 2;
+					Vec4* block = allocateBodies(capacity);
+					std::copy(bodies, bodies + body_count, block);
+					releaseBodies(bodies);
+					bodies = block;
+					body_capacity = capacity;
+				}
+
+				bodies[body_count++] = point;
+				is_clean = false;
+				return true;
+			}
+
+			// Turn a full leaf into an interior node over the octants its bodies and incoming,
+			// the body about to be inserted, fall in. The bodies are counted per octant first,
+			// so the block of children and each child's bucket are allocated once at their
+			// exact size.
+			void split(const Vec4& incoming)
+			{
+				Vec4* held = bodies;
+				const uint32_t count = body_count;
+				bodies = nullptr;
+				body_count = 0;
+				body_capacity = 0;
+
+				uint32_t counts[8] = {};
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					counts[getOctantContainingPoint(held[i])]++;
+				}
+				child_mask = uint8_t(1u << getOctantContainingPoint(incoming));
+				for (int octant = 0; octant < 8; ++octant)
+				{
+					if (counts[octant] != 0)
+					{
+						child_mask |= uint8_t(1u << octant);
+					}
+				}
 
-				x_acc += a.x * a.w;
-				y_acc += a.y * a.w;
-				z_acc += a.z * a.w;
-				w_acc += a.w;
+				children = allocateSiblings(childCount());
+				for (int octant = 0, index = 0; octant < 8; ++octant)
+				{
+					if ((child_mask & (1u << octant)) == 0)
+					{
+						continue;
+					}
+					const Vec4 cell = octantCentre(octant);
+					Octree* child = new (&children[index++]) Octree(cell, cell.w, arena, bucket_size);
+					if (counts[octant] != 0)
+					{
+						child->bodies = allocateBodies(counts[octant]);
+						child->body_capacity = counts[octant];
+						child->is_clean = false;
+					}
+				}
+				if (quadrupole != nullptr)
+				{
+					attachMoments(children, childCount());
+				}
 
-				x_acc += b.x * b.w;
-				y_acc += b.y * b.w;
-				z_acc += b.z * b.w;
-				w_acc += b.w;
+				// The held bodies are already apart and no more than a bucket, so they go
+				// straight in, keeping their order
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					const int octant = getOctantContainingPoint(held[i]);
+					Octree& child = children[CountBits(child_mask & ((1u << octant) - 1u))];
+					child.bodies[child.body_count++] = held[i];
+				}
 
-				return Vec4(x_acc / w_acc,
-				 y_acc / w_acc,
-				 z_acc / w_acc,
-				 w_acc);
+				// incoming's child may still be empty, insert() updates it once it's added
+				for (unsigned i = 0, n = childCount(); i < n; ++i)
+				{
+					if (children[i].body_count != 0)
+					{
+						children[i].UpdateCentreOfMass();
+					}
+				}
+				releaseBodies(held);
 			}
 
 			void UpdateCentreOfMass()
 			{
-				// Centre of mass can be calculated by the 
+				if (isLeafNode() && body_count == 1)
+				{
+					// A lone body is exactly its own centre of mass
+					origin = bodies[0];
+					bmax = 0.0f;
+					if (quadrupole != nullptr)
+					{
+						*quadrupole = Quadrupole();
+					}
+					return;
+				}
+
+				// Centre of mass can be calculated by the
 				// sum of mass-position products over the total mass of the system
-				assert(!isLeafNode());
 				double x_acc = 0.0;
 				double y_acc = 0.0;
 				double z_acc = 0.0;
 				double w_acc = 0.0;
 
-				for (auto &c : children)
+				const Vec4* parts = isLeafNode() ? bodies : nullptr;
+				const unsigned part_count = isLeafNode() ? body_count : childCount();
+				auto part = [&](unsigned i) -> const Vec4& { return parts != nullptr ? parts[i] : children[i].origin; };
+
+				for (unsigned i = 0; i < part_count; ++i)
 				{
-					const Vec4 p = c->origin;
+					const Vec4 p = part(i);
 					x_acc += p.x * p.w;
 					y_acc += p.y * p.w;
 					z_acc += p.z * p.w;
@@ -246,7 +668,224 @@ namespace brandonpelfrey {
 				origin.y = y_acc / w_acc;
 				origin.z = z_acc / w_acc;
 				origin.w = w_acc;
+
+				// Bound the spread of the bodies through the children's own bounds, and
+				// shift the children's moments onto the new centre
+				double spread = 0.0;
+				Quadrupole moment;
+				for (unsigned i = 0; i < part_count; ++i)
+				{
+					const Vec4 d = part(i) - origin;
+					if (parts != nullptr)
+					{
+						spread = std::max(spread, std::sqrt(d.normSquared()));
+						if (quadrupole != nullptr)
+						{
+							moment.add(d, part(i).w);
+						}
+					}
+					else
+					{
+						spread = std::max(spread, std::sqrt(d.normSquared()) + double(children[i].bmax));
+						if (quadrupole != nullptr)
+						{
+							moment.add(d, part(i).w, *children[i].quadrupole);
+						}
+					}
+				}
+				bmax = RoundUpToFloat(spread);
+				if (quadrupole != nullptr)
+				{
+					*quadrupole = moment;
+				}
+			}
+	};
+
+
+	/*
+		Arena for octree nodes and leaf bodies. Blocks of siblings and body buckets are
+		carved out of large chunks. reset() releases everything in O(1) by rewinding the
+		cursors; the chunks stay around, so steady state frames don't touch the heap at all.
+		Blocks that are outgrown aren't reused before the reset. Nodes are never destroyed
+		individually, the tree must be dropped before reset().
+	*/
+	class OctreeArena {
+		template<typename T>
+		class Pool {
+			struct alignas(T) Slot {
+				unsigned char bytes[sizeof(T)];
+			};
+
+			struct Chunk {
+				std::unique_ptr<Slot[]> slots;
+				size_t size;
+			};
+
+			std::vector<Chunk> chunks;
+			size_t chunk = 0; //! Chunk currently being carved
+			size_t used = 0;  //! Slots handed out from that chunk
+
+		public:
+			T* allocate(size_t count, size_t per_chunk)
+			{
+				// Skip chunks too small for the block, a block never straddles two
+				while (chunk < chunks.size() && used + count > chunks[chunk].size)
+				{
+					chunk++;
+					used = 0;
+				}
+
+				if (chunk == chunks.size())
+				{
+					const size_t size = std::max(count, per_chunk);
+					chunks.push_back(Chunk{ std::unique_ptr<Slot[]>(new Slot[size]), size });
+					OCTREE_ALLOCATIONS.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				T* block = reinterpret_cast<T*>(chunks[chunk].slots[used].bytes);
+				used += count;
+				return block;
 			}
+
+			void reset()
+			{
+				chunk = 0;
+				used = 0;
+			}
+
+			size_t chunkCount() const
+			{
+				return chunks.size();
+			}
+
+			size_t capacity() const
+			{
+				size_t res = 0;
+				for (const auto& c : chunks)
+					res += c.size * sizeof(Slot);
+				return res;
+			}
+		};
+
+		static const constexpr size_t NODES_PER_CHUNK = 4096 * 8;
+		static const constexpr size_t BODIES_PER_CHUNK = 4096 * 8;
+		static const constexpr size_t MOMENTS_PER_CHUNK = 4096 * 8;
+
+		Pool<Octree> nodes;
+		Pool<Vec4> bodies;
+		Pool<Quadrupole> moments;
+
+	public:
+		OctreeArena()
+		{
+		}
+
+		OctreeArena(const OctreeArena&) = delete;
+		OctreeArena& operator=(const OctreeArena&) = delete;
+
+		~OctreeArena()
+		{
+			OCTREE_FREES.fetch_add(nodes.chunkCount() + bodies.chunkCount() + moments.chunkCount(), std::memory_order_relaxed);
+		}
+
+		// Uninitialised storage for count contiguous siblings
+		Octree* allocateSiblings(unsigned count)
+		{
+			return nodes.allocate(count, NODES_PER_CHUNK);
+		}
+
+		Vec4* allocateBodies(uint32_t count)
+		{
+			return bodies.allocate(count, BODIES_PER_CHUNK);
+		}
+
+		Quadrupole* allocateMoments(unsigned count)
+		{
+			return moments.allocate(count, MOMENTS_PER_CHUNK);
+		}
+
+		// Release every node handed out since the last reset
+		void reset()
+		{
+			nodes.reset();
+			bodies.reset();
+			moments.reset();
+		}
+
+		// Bytes reserved from the heap
+		size_t capacity() const
+		{
+			return nodes.capacity() + bodies.capacity() + moments.capacity();
+		}
 	};
 
+	inline Octree* Octree::allocateSiblings(unsigned count)
+	{
+		if (arena != nullptr)
+		{
+			return arena->allocateSiblings(count);
+		}
+
+		OCTREE_ALLOCATIONS.fetch_add(1, std::memory_order_relaxed);
+		return static_cast<Octree*>(::operator new(sizeof(Octree) * count, std::align_val_t(alignof(Octree))));
+	}
+
+	inline Vec4* Octree::allocateBodies(uint32_t count)
+	{
+		if (arena != nullptr)
+		{
+			return arena->allocateBodies(count);
+		}
+
+		OCTREE_ALLOCATIONS.fetch_add(1, std::memory_order_relaxed);
+		return new Vec4[count];
+	}
+
+	inline void Octree::releaseBodies(Vec4* block)
+	{
+		if (arena == nullptr && block != nullptr)
+		{
+			delete[] block;
+			OCTREE_FREES.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	inline Quadrupole* Octree::allocateMoments(unsigned count)
+	{
+		if (arena != nullptr)
+		{
+			return arena->allocateMoments(count);
+		}
+
+		OCTREE_ALLOCATIONS.fetch_add(1, std::memory_order_relaxed);
+		return static_cast<Quadrupole*>(::operator new(sizeof(Quadrupole) * count));
+	}
+
+	inline void Octree::releaseMoments(Quadrupole* block)
+	{
+		if (arena == nullptr && block != nullptr)
+		{
+			::operator delete(block);
+			OCTREE_FREES.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Drop a block of siblings whose own children, bodies and moments have been moved out
+	// or freed
+	inline void Octree::FreeSiblings(Octree* block, unsigned count)
+	{
+		const bool heap = block[0].arena == nullptr;
+		for (unsigned i = 0; i < count; ++i)
+		{
+			block[i].quadrupole = nullptr;
+			block[i].~Octree();
+		}
+
+		if (heap)
+		{
+			::operator delete(block, std::align_val_t(alignof(Octree)));
+			OCTREE_FREES.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
 }
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "Vec4.h"
+#include <algorithm>
+#include <cmath>
+
+/*
+	Multipole acceptance criteria, passed to the tree traversals as a template policy.
+
+	accept() decides whether a cell at squared distance dist_sqr from the target (measured
+	to its centre of mass) may be replaced by its centre of mass. half_width is the
+	geometric half-width of the cell, bmax the largest distance from the centre of mass to
+	any body inside it. includes() decides whether a single body interacts at all, and
+	INCLUDES_ALL says it always does.
+
+	accept() only ever accepts more as the distance grows, so a group of targets can share
+	a walk by testing at the distance of its nearest member, see BoundingBox. includes()
+	doesn't hold to that for the radius criterion, which drops bodies beyond the radius:
+	tested at the nearest member, a group would keep bodies its other members drop. Group
+	walks are only run for criteria with INCLUDES_ALL, see ForcePass::runGroups().
+*/
+
+// The original fixed radius test: cells further than the radius are approximated, and
+// bodies further than it are left out entirely
+struct RadiusCriterion {
+	static const constexpr bool INCLUDES_ALL = false;
+
+	double radius_sqr;
+
+	explicit constexpr RadiusCriterion(double radius)
+		: radius_sqr(radius * radius)
+	{
+	}
+
+	static constexpr RadiusCriterion fromSquared(double radius_sqr)
+	{
+		RadiusCriterion res(0.0);
+		res.radius_sqr = radius_sqr;
+		return res;
+	}
+
+	bool accept(double dist_sqr, double, double) const
+	{
+		return dist_sqr > radius_sqr;
+	}
+
+	bool includes(double dist_sqr) const
+	{
+		return dist_sqr <= radius_sqr;
+	}
+};
+
+// Classic Barnes-Hut: accept when cell size s over distance d is below theta
+struct BarnesHutCriterion {
+	static const constexpr bool INCLUDES_ALL = true;
+
+	double theta_sqr;
+
+	explicit constexpr BarnesHutCriterion(double theta)
+		: theta_sqr(theta * theta)
+	{
+	}
+
+	bool accept(double dist_sqr, double half_width, double) const
+	{
+		const double size = 2.0 * half_width;
+		return size * size < theta_sqr * dist_sqr;
+	}
+
+	bool includes(double) const
+	{
+		return true;
+	}
+};
+
+// Salmon & Warren: accept when d > bmax / theta. Unlike s / d it stays safe when the
+// centre of mass sits near a corner of a large, sparsely filled cell.
+struct SalmonWarrenCriterion {
+	static const constexpr bool INCLUDES_ALL = true;
+
+	double theta_sqr;
+
+	explicit constexpr SalmonWarrenCriterion(double theta)
+		: theta_sqr(theta * theta)
+	{
+	}
+
+	bool accept(double dist_sqr, double, double bmax) const
+	{
+		return bmax * bmax < theta_sqr * dist_sqr;
+	}
+
+	bool includes(double) const
+	{
+		return true;
+	}
+};
+
+// Axis aligned box around a group of targets. distanceSqr() is the squared distance from a
+// point to the nearest point of the box, zero inside it: a cell accepted at that distance is
+// accepted for every target in the box.
+struct BoundingBox {
+	Vec4 lo;
+	Vec4 hi;
+
+	BoundingBox()
+		: lo(HUGE_VAL, HUGE_VAL, HUGE_VAL, 0.0)
+		, hi(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL, 0.0)
+	{
+	}
+
+	void add(const Vec4& p)
+	{
+		lo = Vec4(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z), 0.0);
+		hi = Vec4(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z), 0.0);
+	}
+
+	double distanceSqr(const Vec4& p) const
+	{
+		const double dx = std::max(0.0, std::max(lo.x - p.x, p.x - hi.x));
+		const double dy = std::max(0.0, std::max(lo.y - p.y, p.y - hi.y));
+		const double dz = std::max(0.0, std::max(lo.z - p.z, p.z - hi.z));
+		return dx * dx + dy * dy + dz * dz;
+	}
+};
+
+// Narrow a bound to float for storage in a node without letting it shrink
+inline float RoundUpToFloat(double v)
+{
+	const float res = static_cast<float>(v);
+	return static_cast<double>(res) < v ? std::nextafter(res, HUGE_VALF) : res;
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#endif
+
+/*
+	Hardware performance counters through Linux perf_event_open.
+
+	Counters are opened for the calling thread with inherit set, so threads it creates
+	afterwards are counted too: open them before the ThreadPool whose work they should
+	cover. Each event is opened on its own and the kernel multiplexes them when there are
+	more than the PMU has registers, so values are scaled by the fraction of time each was
+	actually counting. Events the host doesn't offer (virtual machines often have none,
+	and floating point operations are only read on Intel) are reported as unavailable,
+	and on other platforms every event is.
+*/
+enum class PerfEvent {
+	Cycles,
+	Instructions,
+	L1DMisses,    //! L1 data cache read misses
+	LLCMisses,    //! Last level cache misses
+	BranchMisses,
+	FpOps,        //! FP_ARITH_INST_RETIRED, scalar and packed arithmetic instructions
+	TaskClock,    //! CPU time in nanoseconds, a software event available everywhere
+};
+
+const constexpr size_t PERF_EVENTS = 7;
+
+inline const char* PerfEventName(PerfEvent e)
+{
+	switch (e)
+	{
+	case PerfEvent::Cycles: return "cycles";
+	case PerfEvent::Instructions: return "instructions";
+	case PerfEvent::L1DMisses: return "l1d_misses";
+	case PerfEvent::LLCMisses: return "llc_misses";
+	case PerfEvent::BranchMisses: return "branch_misses";
+	case PerfEvent::FpOps: return "fp_ops";
+	case PerfEvent::TaskClock: return "task_clock_ns";
+	}
+	return "unknown";
+}
+
+// Counts of every event over some span. Events that couldn't be read are marked invalid.
+struct PerfSample {
+	double values[PERF_EVENTS] = {};
+	bool valid[PERF_EVENTS] = {};
+
+	double operator[](PerfEvent e) const
+	{
+		return values[size_t(e)];
+	}
+
+	bool has(PerfEvent e) const
+	{
+		return valid[size_t(e)];
+	}
+
+	PerfSample& operator+=(const PerfSample& other)
+	{
+		for (size_t i = 0; i < PERF_EVENTS; i++)
+		{
+			values[i] += other.values[i];
+			valid[i] = valid[i] || other.valid[i];
+		}
+		return *this;
+	}
+
+	PerfSample operator-(const PerfSample& other) const
+	{
+		PerfSample res;
+		for (size_t i = 0; i < PERF_EVENTS; i++)
+		{
+			res.values[i] = values[i] - other.values[i];
+			res.valid[i] = valid[i] && other.valid[i];
+		}
+		return res;
+	}
+
+	// Instructions per cycle, 0 without both counters
+	double ipc() const
+	{
+		return has(PerfEvent::Cycles) && has(PerfEvent::Instructions) && (*this)[PerfEvent::Cycles] > 0.0
+			? (*this)[PerfEvent::Instructions] / (*this)[PerfEvent::Cycles] : 0.0;
+	}
+};
+
+class PerfCounters {
+	int fds[PERF_EVENTS];
+
+public:
+	PerfCounters()
+	{
+		for (size_t i = 0; i < PERF_EVENTS; i++)
+		{
+			fds[i] = open(PerfEvent(i));
+		}
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	~PerfCounters()
+	{
+#ifdef __linux__
+		for (int fd : fds)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+#endif
+	}
+
+	bool available(PerfEvent e) const
+	{
+		return fds[size_t(e)] >= 0;
+	}
+
+	// Current totals since the counters were opened; subtract two reads for a span
+	PerfSample read() const
+	{
+		PerfSample res;
+#ifdef __linux__
+		for (size_t i = 0; i < PERF_EVENTS; i++)
+		{
+			// value, time enabled, time running
+			uint64_t data[3] = {};
+			if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != ssize_t(sizeof(data)) || data[2] == 0)
+			{
+				continue;
+			}
+			res.values[i] = double(data[0]) * double(data[1]) / double(data[2]);
+			res.valid[i] = true;
+		}
+#endif
+		return res;
+	}
+
+private:
+	static int open(PerfEvent e)
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		switch (e)
+		{
+		case PerfEvent::Cycles:
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case PerfEvent::Instructions:
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case PerfEvent::L1DMisses:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case PerfEvent::LLCMisses:
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+		case PerfEvent::BranchMisses:
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		case PerfEvent::FpOps:
+			// Raw event 0xC7 with every umask bit set, only meaningful on Intel
+			if (!IsIntel())
+			{
+				return -1;
+			}
+			attr.type = PERF_TYPE_RAW;
+			attr.config = 0xFFC7;
+			break;
+		case PerfEvent::TaskClock:
+			attr.type = PERF_TYPE_SOFTWARE;
+			attr.config = PERF_COUNT_SW_TASK_CLOCK;
+			break;
+		}
+
+		return int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+		(void)e;
+		return -1;
+#endif
+	}
+
+	static bool IsIntel()
+	{
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+		unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+		if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+		{
+			return false;
+		}
+		char vendor[13] = {};
+		std::memcpy(vendor, &ebx, 4);
+		std::memcpy(vendor + 4, &edx, 4);
+		std::memcpy(vendor + 8, &ecx, 4);
+		return std::strcmp(vendor, "GenuineIntel") == 0;
+#else
+		return false;
+#endif
+	}
+};
+
+// One line per phase: IPC, then every available event per interaction
+inline void PrintPerfPhase(const char* phase, const PerfSample& s, double interactions, std::ostream& out)
+{
+	out << phase << ":";
+	if (s.has(PerfEvent::Cycles) && s.has(PerfEvent::Instructions))
+	{
+		out << " IPC " << s.ipc() << ",";
+	}
+
+	bool any = false;
+	for (size_t i = 0; i < PERF_EVENTS; i++)
+	{
+		if (s.valid[i])
+		{
+			out << " " << PerfEventName(PerfEvent(i)) << " " << s.values[i];
+			if (interactions > 0.0)
+			{
+				out << " (" << s.values[i] / interactions << " per interaction)";
+			}
+			any = true;
+		}
+	}
+	if (!any)
+	{
+		out << " no counters available";
+	}
+	out << std::endl;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Vec4.h"
+#include <cmath>
+
+/*
+	Traceless quadrupole moment of a cell about its centre of mass,
+
+		Q = sum m (3 d d^T - |d|^2 I)
+
+	over the bodies at offset d from the centre. Symmetric, so six components are kept.
+	Adding it to the monopole cancels the leading error of replacing a cell by its centre
+	of mass, which lets the opening criteria accept much closer cells for the same error.
+*/
+struct Quadrupole {
+	double xx, xy, xz, yy, yz, zz;
+
+	Quadrupole()
+		: xx(0.0), xy(0.0), xz(0.0), yy(0.0), yz(0.0), zz(0.0)
+	{
+	}
+
+	// Accumulate a mass m at offset d from the centre, carrying its own moment q
+	// about that point along (the parallel axis theorem)
+	void add(const Vec4& d, double m, const Quadrupole& q)
+	{
+		const double r2 = d.normSquared();
+		xx += q.xx + m * (3.0 * d.x * d.x - r2);
+		xy += q.xy + m * (3.0 * d.x * d.y);
+		xz += q.xz + m * (3.0 * d.x * d.z);
+		yy += q.yy + m * (3.0 * d.y * d.y - r2);
+		yz += q.yz + m * (3.0 * d.y * d.z);
+		zz += q.zz + m * (3.0 * d.z * d.z - r2);
+	}
+
+	// Point masses have no moment of their own
+	void add(const Vec4& d, double m)
+	{
+		add(d, m, Quadrupole());
+	}
+};
+
+// Quadrupole part of the force a cell with centre of mass com exerts on target (w holds
+// its mass). The monopole part is left to the force kernels.
+inline Vec4 QuadrupoleForce(const Vec4& target, const Vec4& com, const Quadrupole& q, double G)
+{
+	const Vec4 r = target - com;
+	const double r2 = r.normSquared();
+	if (r2 == 0.0)
+	{
+		return Vec4(0.0, 0.0, 0.0, 0.0);
+	}
+
+	// a = G (Q r / |r|^5 - 5/2 (r.Q.r) r / |r|^7)
+	const double qx = q.xx * r.x + q.xy * r.y + q.xz * r.z;
+	const double qy = q.xy * r.x + q.yy * r.y + q.yz * r.z;
+	const double qz = q.xz * r.x + q.yz * r.y + q.zz * r.z;
+	const double rqr = r.x * qx + r.y * qy + r.z * qz;
+
+	const double inv_r2 = 1.0 / r2;
+	const double inv_r5 = inv_r2 * inv_r2 / std::sqrt(r2);
+	const double scale = G * target.w * inv_r5;
+	const double radial = 2.5 * rqr * inv_r2;
+	return Vec4(scale * (qx - radial * r.x),
+		scale * (qy - radial * r.y),
+		scale * (qz - radial * r.z),
+		0.0);
+}
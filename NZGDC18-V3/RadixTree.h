@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Morton.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+	Binary radix tree over sorted, unique Morton keys (Karras 2012, "Maximizing Parallelism
+	in the Construction of BVHs, Octrees, and k-d Trees").
+
+	For m keys there are m leaves (leaf i is key i) and m - 1 internal nodes, internal node 0
+	being the root. Every internal node is built independently from the keys alone, so the
+	whole tree is constructed in one parallel pass. Child references below LEAF_FLAG are
+	internal nodes, references with LEAF_FLAG set are leaves.
+*/
+class RadixTree {
+public:
+	static const constexpr uint32_t LEAF_FLAG = 0x80000000u;
+	static const constexpr uint32_t NO_PARENT = 0xFFFFFFFFu;
+
+	std::vector<uint32_t> left;          //! Left child of each internal node
+	std::vector<uint32_t> right;         //! Right child of each internal node
+	std::vector<uint32_t> first;         //! First key covered by each internal node
+	std::vector<uint32_t> last;          //! Last key (inclusive) covered by each internal node
+	std::vector<uint8_t> prefix;         //! Common prefix length in bits of each internal node
+	std::vector<uint32_t> parent;        //! Parent of each internal node
+	std::vector<uint32_t> leaf_parent;   //! Parent of each leaf
+
+	void build(const std::vector<uint64_t>& keys, ThreadPool& pool)
+	{
+		const size_t m = keys.size();
+		const size_t internal = m > 0 ? m - 1 : 0;
+
+		left.resize(internal);
+		right.resize(internal);
+		first.resize(internal);
+		last.resize(internal);
+		prefix.resize(internal);
+		parent.resize(internal);
+		leaf_parent.resize(m);
+
+		if (m == 0)
+		{
+			return;
+		}
+		if (internal > 0)
+		{
+			parent[0] = NO_PARENT;
+		}
+		leaf_parent[0] = NO_PARENT;
+
+		const int64_t count = static_cast<int64_t>(m);
+		auto delta = [&](int64_t i, int64_t j) -> int
+		{
+			if (j < 0 || j >= count)
+			{
+				return -1;
+			}
+			return static_cast<int>(MortonCommonPrefix(keys[i], keys[j]));
+		};
+
+		pool.parallelFor(0, internal, 1024, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t node = begin; node < end; node++)
+			{
+				const int64_t i = static_cast<int64_t>(node);
+
+				// Direction of the range: towards the neighbour sharing the longer prefix
+				const int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+				const int delta_min = delta(i, i - d);
+
+				// Exponential then binary search for the other end of the range
+				int64_t l_max = 2;
+				while (delta(i, i + l_max * d) > delta_min)
+				{
+					l_max *= 2;
+				}
+
+				int64_t l = 0;
+				for (int64_t t = l_max / 2; t >= 1; t /= 2)
+				{
+					if (delta(i, i + (l + t) * d) > delta_min)
+					{
+						l += t;
+					}
+				}
+				const int64_t j = i + l * d;
+				const int delta_node = delta(i, j);
+
+				// Binary search for the split: the last key sharing more than delta_node bits with i
+				int64_t s = 0;
+				int64_t t = l;
+				do
+				{
+					t = (t + 1) / 2;
+					if (delta(i, i + (s + t) * d) > delta_node)
+					{
+						s += t;
+					}
+				} while (t > 1);
+				const int64_t gamma = i + s * d + std::min(d, 0);
+
+				const int64_t lo = std::min(i, j);
+				const int64_t hi = std::max(i, j);
+
+				const uint32_t split = static_cast<uint32_t>(gamma);
+				left[node] = lo == gamma ? (split | LEAF_FLAG) : split;
+				right[node] = hi == gamma + 1 ? ((split + 1) | LEAF_FLAG) : split + 1;
+				first[node] = static_cast<uint32_t>(lo);
+				last[node] = static_cast<uint32_t>(hi);
+				prefix[node] = static_cast<uint8_t>(delta_node);
+
+				// Each child has exactly one parent, so these writes never collide
+				if (lo == gamma)
+					leaf_parent[split] = static_cast<uint32_t>(node);
+				else
+					parent[split] = static_cast<uint32_t>(node);
+
+				if (hi == gamma + 1)
+					leaf_parent[split + 1] = static_cast<uint32_t>(node);
+				else
+					parent[split + 1] = static_cast<uint32_t>(node);
+			}
+		});
+	}
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "BodyOrder.h"
+#include "Fmm.h"
+#include "ForceKernels.h"
+#include "ForcePass.h"
+#include "LinearOctree.h"
+#include "OpeningCriteria.h"
+#include "ThreadPool.h"
+#include "TraversalStats.h"
+#include "Vec4.h"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// How a Simulation computes its accelerations
+enum class ForceSolver {
+	TreeWalk, //! Barnes-Hut, every body walking the tree
+	Fmm       //! Dual-tree fast multipole, see Fmm.h
+};
+
+/*
+	Persistent N-body simulation state.
+
+	Owns positions (w holds the mass), velocities and accelerations across steps and
+	advances them with kick-drift-kick leapfrog:
+
+		v += a * dt / 2
+		x += v * dt
+		a  = forces(x) / m
+		v += a * dt / 2
+
+	Accelerations come from a Barnes-Hut pass over a LinearOctree, opening cells as the
+	Criterion policy from OpeningCriteria.h decides, with groups of neighbouring bodies
+	sharing each walk. Between steps bodies move only a little, so after a drift the tree
+	is refit rather than rebuilt, and only rebuilt once the interactions per step have
+	grown by REBUILD_GROWTH over the last rebuild. Body arrays are sized once, and the
+	tree and force pass reuse their buffers, so stepping never reallocates body state.
+
+	setSolver() switches to the FmmSolver instead, which takes its own opening angle in
+	place of the Criterion and needs a freshly built tree every step.
+
+	setBodyOrder() permutes the bodies along a space filling curve after every build, see
+	BodyOrder.h. The getters then return bodies in that order, consistent with each other,
+	and restoreOrder() puts any of them back in input order for output.
+*/
+template <typename Criterion>
+class Simulation {
+	std::vector<Vec4> positions;
+	std::vector<Vec4> velocities;
+	std::vector<Vec4> accelerations;
+
+	LinearOctree tree;
+	BodyReorder reorder;
+	ForcePass<LinearOctree> force_pass;
+	FmmSolver fmm;
+	ThreadPool& pool;
+	ForceKernel kernel;
+	double G;
+	Criterion criterion;
+	ForceSolver solver;
+	bool quadrupoles;
+	uint32_t group_size;
+
+	bool refit_enabled;
+	double rebuild_growth;
+	bool needs_rebuild;
+	size_t rebuild_interactions; //! Interactions of the pass following the last rebuild
+
+	size_t steps;
+	size_t last_interactions;
+	InteractionStats last_stats;
+	size_t last_migrations;
+	size_t rebuilds;
+
+public:
+	static const constexpr double REBUILD_GROWTH = 0.1; //! Default interaction growth that triggers a rebuild
+
+	Simulation(std::vector<Vec4> bodies, ThreadPool& pool, ForceKernel kernel, double G, const Criterion& criterion)
+		: positions(std::move(bodies))
+		, velocities(positions.size(), Vec4(0.0, 0.0, 0.0, 0.0))
+		, accelerations(positions.size(), Vec4(0.0, 0.0, 0.0, 0.0))
+		, pool(pool)
+		, kernel(kernel)
+		, G(G)
+		, criterion(criterion)
+		, solver(ForceSolver::TreeWalk)
+		, quadrupoles(false)
+		, group_size(ForcePass<LinearOctree>::GROUP_SIZE)
+		, refit_enabled(true)
+		, rebuild_growth(REBUILD_GROWTH)
+		, needs_rebuild(true)
+		, rebuild_interactions(0)
+		, steps(0)
+		, last_interactions(0)
+		, last_stats()
+		, last_migrations(0)
+		, rebuilds(0)
+	{
+		// Leapfrog needs the accelerations at the starting positions
+		computeAccelerations();
+	}
+
+	// v in input order
+	void setVelocities(const std::vector<Vec4>& v)
+	{
+		reorder.permute(v, velocities);
+	}
+
+	// With refit disabled the tree is rebuilt every step
+	void setRefit(bool enabled, double growth = REBUILD_GROWTH)
+	{
+		refit_enabled = enabled;
+		rebuild_growth = growth;
+	}
+
+	// Add quadrupole moments to accepted cells. Rebuilds the tree so the accelerations
+	// going into the next step already include them.
+	void setQuadrupoles(bool enabled)
+	{
+		quadrupoles = enabled;
+		force_pass.setQuadrupoles(enabled);
+		configureTree();
+		needs_rebuild = true;
+		computeAccelerations();
+	}
+
+	// Bodies sharing one tree walk, 1 walks the tree for every body
+	void setGroupSize(uint32_t size)
+	{
+		group_size = size;
+	}
+
+	// Select the force solver. theta is the FMM opening angle and is ignored by the tree
+	// walk. The FMM always translates quadrupoles, so the tree keeps them while it's used.
+	void setSolver(ForceSolver s, double theta = FmmSolver::THETA)
+	{
+		solver = s;
+		fmm.setTheta(theta);
+		configureTree();
+		needs_rebuild = true;
+		computeAccelerations();
+	}
+
+	ForceSolver getSolver() const
+	{
+		return solver;
+	}
+
+	// Reorder the bodies along a curve after each build. Rebuilds the tree so the bodies
+	// are in order for the next step.
+	void setBodyOrder(BodyOrder order)
+	{
+		reorder.setOrder(order);
+		needs_rebuild = true;
+		computeAccelerations();
+	}
+
+	BodyOrder getBodyOrder() const
+	{
+		return reorder.getOrder();
+	}
+
+	// values, one per body as the getters return them, in input order into out
+	void restoreOrder(const std::vector<Vec4>& values, std::vector<Vec4>& out) const
+	{
+		reorder.restore(values, out);
+	}
+
+	void step(double dt)
+	{
+		const double half_dt = 0.5 * dt;
+		kick(half_dt);
+		drift(dt);
+		computeAccelerations();
+		kick(half_dt);
+		steps++;
+	}
+
+	void run(size_t n, double dt)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			step(dt);
+		}
+	}
+
+	size_t size() const
+	{
+		return positions.size();
+	}
+
+	size_t getSteps() const
+	{
+		return steps;
+	}
+
+	// Interactions evaluated by the most recent force pass
+	size_t getLastInteractions() const
+	{
+		return last_interactions;
+	}
+
+	// Walk counts and leaf depths of the most recent force pass. The FMM has no per body
+	// walks, so only its evaluated interactions and the tree's depths are filled in.
+	const InteractionStats& getLastStats() const
+	{
+		return last_stats;
+	}
+
+	// Bodies that changed node in the most recent refit
+	size_t getLastMigrations() const
+	{
+		return last_migrations;
+	}
+
+	// Full tree builds, including the initial one
+	size_t getRebuilds() const
+	{
+		return rebuilds;
+	}
+
+	const std::vector<Vec4>& getPositions() const
+	{
+		return positions;
+	}
+
+	const std::vector<Vec4>& getVelocities() const
+	{
+		return velocities;
+	}
+
+	const std::vector<Vec4>& getAccelerations() const
+	{
+		return accelerations;
+	}
+
+	const LinearOctree& getTree() const
+	{
+		return tree;
+	}
+
+private:
+	void kick(double dt)
+	{
+		pool.parallelFor(0, positions.size(), ForcePass<LinearOctree>::GRAIN * 16, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				velocities[i].x += dt * accelerations[i].x;
+				velocities[i].y += dt * accelerations[i].y;
+				velocities[i].z += dt * accelerations[i].z;
+			}
+		});
+	}
+
+	void drift(double dt)
+	{
+		pool.parallelFor(0, positions.size(), ForcePass<LinearOctree>::GRAIN * 16, [&](size_t begin, size_t end, size_t)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				positions[i].x += dt * velocities[i].x;
+				positions[i].y += dt * velocities[i].y;
+				positions[i].z += dt * velocities[i].z;
+			}
+		});
+	}
+
+	void configureTree()
+	{
+		tree.setQuadrupoles(quadrupoles || solver == ForceSolver::Fmm);
+	}
+
+	void computeAccelerations()
+	{
+		// The FMM can't walk the loose points a refit leaves behind
+		const bool rebuild = needs_rebuild || !refit_enabled || solver == ForceSolver::Fmm;
+		if (rebuild)
+		{
+			tree.buildParallel(positions, pool);
+
+			// The force pass overwrites every acceleration, so they needn't move
+			reorder.apply(tree, pool, positions, velocities);
+			last_migrations = 0;
+			rebuilds++;
+		}
+		else
+		{
+			last_migrations = tree.refit(positions, pool);
+		}
+
+		if (solver == ForceSolver::Fmm)
+		{
+			last_interactions = fmm.run(tree, G, kernel, pool, accelerations);
+			last_stats = InteractionStats();
+			last_stats.evaluated = last_interactions;
+			tree.getLeafDepths(last_stats.leaf_depths);
+		}
+		else
+		{
+			// A unit mass target makes the kernel return acceleration rather than force
+			auto target = [&](size_t i) { const Vec4& p = positions[i]; return Vec4(p.x, p.y, p.z, 1.0); };
+			auto store = [&](size_t i, const Vec4& a) { accelerations[i] = a; };
+			last_interactions = group_size > 1
+				? force_pass.runGroups(tree, group_size, criterion, G, kernel, pool, target, store)
+				: force_pass.run(tree, positions.size(), criterion, G, kernel, pool, target, store);
+			last_stats = force_pass.stats(tree);
+		}
+
+		// A loosening tree shows up as more interactions per step
+		if (rebuild)
+		{
+			rebuild_interactions = last_interactions;
+		}
+		needs_rebuild = double(last_interactions) > double(rebuild_interactions) * (1.0 + rebuild_growth);
+	}
+};
@@ -0,0 +1,392 @@
+#pragma once
+
+#include "Bodies.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NBODY_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+	Binary body snapshots.
+
+	A snapshot is a 64 byte SnapshotHeader followed by the positions (mass in w) and,
+	optionally, the velocities of every body, each array starting on a 64 byte boundary.
+	Packed snapshots hold both as Vec4 arrays, exactly as std::vector<Vec4> lays them out;
+	SoA snapshots hold x, y, z and w streams per array instead, as Bodies does. Values are
+	IEEE doubles in the writer's byte order, which the header records so a foreign file is
+	rejected rather than misread.
+
+	MappedSnapshot maps a file read-only, so opening one costs the same whatever the body
+	count and pages are only read as they are touched. Loading bodies is not zero-copy:
+	the trees, Bodies and the integrators all work on their own vectors, which every step
+	moves, so getPositions() and getVelocities() copy each array out of the mapping once
+	(a gather for SoA). What the mapping saves is parsing and a read buffer in between.
+*/
+enum class SnapshotLayout : uint32_t {
+	Packed = 0, //! Vec4 arrays
+	Soa = 1,    //! One stream per component
+};
+
+inline const char* SnapshotLayoutName(SnapshotLayout layout)
+{
+	return layout == SnapshotLayout::Soa ? "soa" : "packed";
+}
+
+inline bool ParseSnapshotLayout(const char* name, SnapshotLayout& res)
+{
+	for (auto layout : { SnapshotLayout::Packed, SnapshotLayout::Soa })
+	{
+		if (std::strcmp(name, SnapshotLayoutName(layout)) == 0)
+		{
+			res = layout;
+			return true;
+		}
+	}
+	return false;
+}
+
+const constexpr char SNAPSHOT_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P' };
+const constexpr uint32_t SNAPSHOT_VERSION = 1;
+const constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304; //! Reads back swapped on a foreign machine
+const constexpr uint32_t SNAPSHOT_VELOCITIES = 1;          //! Flag: velocities follow the positions
+const constexpr size_t SNAPSHOT_ALIGN = 64;
+
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t layout;      //! SnapshotLayout
+	uint32_t flags;
+	uint64_t count;       //! Bodies
+	uint64_t step;        //! Simulation step the snapshot was taken at
+	double time;          //! Simulated time at that step
+	uint64_t positions;   //! Byte offset of the positions
+	uint64_t velocities;  //! Byte offset of the velocities, 0 without them
+};
+
+static_assert(sizeof(SnapshotHeader) == 64, "Snapshot headers are one cache line");
+static_assert(sizeof(Vec4) == 4 * sizeof(double), "Packed snapshots are Vec4 arrays");
+
+inline uint64_t SnapshotAlignUp(uint64_t bytes)
+{
+	return (bytes + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+// Bytes between the streams of an SoA array
+inline uint64_t SnapshotStreamStride(uint64_t count)
+{
+	return SnapshotAlignUp(count * sizeof(double));
+}
+
+// Bytes of one array of count bodies, padding included
+inline uint64_t SnapshotArrayBytes(SnapshotLayout layout, uint64_t count)
+{
+	return layout == SnapshotLayout::Soa ? 4 * SnapshotStreamStride(count) : SnapshotAlignUp(count * sizeof(Vec4));
+}
+
+// Write positions, and velocities unless null, to path. Returns false, with the reason
+// on err, if the file can't be written.
+inline bool WriteSnapshot(const char* path, const std::vector<Vec4>& positions, const std::vector<Vec4>* velocities,
+	SnapshotLayout layout, uint64_t step, double time, std::ostream& err)
+{
+	const uint64_t count = positions.size();
+	if (velocities != nullptr && velocities->size() != count)
+	{
+		err << "Snapshot velocities don't match its " << count << " positions\n";
+		return false;
+	}
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.layout = uint32_t(layout);
+	header.flags = velocities != nullptr ? SNAPSHOT_VELOCITIES : 0;
+	header.count = count;
+	header.step = step;
+	header.time = time;
+	header.positions = SnapshotAlignUp(sizeof(SnapshotHeader));
+	header.velocities = velocities != nullptr ? header.positions + SnapshotArrayBytes(layout, count) : 0;
+
+	std::FILE* file = std::fopen(path, "wb");
+	if (file == nullptr)
+	{
+		err << "Can't create snapshot " << path << "\n";
+		return false;
+	}
+
+	static const unsigned char zeros[SNAPSHOT_ALIGN] = {};
+	bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+	auto pad = [&](uint64_t bytes)
+	{
+		ok = ok && std::fwrite(zeros, 1, size_t(SnapshotAlignUp(bytes) - bytes), file) == size_t(SnapshotAlignUp(bytes) - bytes);
+	};
+	pad(sizeof(header));
+
+	// SoA streams are transposed through a fixed buffer rather than a copy of the array
+	std::vector<double> stream(std::min<uint64_t>(count, 1 << 16));
+	auto write = [&](const std::vector<Vec4>& array)
+	{
+		if (layout == SnapshotLayout::Packed)
+		{
+			ok = ok && std::fwrite(array.data(), sizeof(Vec4), array.size(), file) == array.size();
+			pad(count * sizeof(Vec4));
+			return;
+		}
+
+		for (unsigned c = 0; c < 4; c++)
+		{
+			for (size_t first = 0; first < array.size(); first += stream.size())
+			{
+				const size_t n = std::min(stream.size(), array.size() - first);
+				for (size_t i = 0; i < n; i++)
+				{
+					stream[i] = array[first + i][c];
+				}
+				ok = ok && std::fwrite(stream.data(), sizeof(double), n, file) == n;
+			}
+			pad(count * sizeof(double));
+		}
+	};
+	write(positions);
+	if (velocities != nullptr)
+	{
+		write(*velocities);
+	}
+
+	ok = std::fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		err << "Failed writing snapshot " << path << "\n";
+	}
+	return ok;
+}
+
+class MappedSnapshot {
+	const unsigned char* data = nullptr;
+	size_t bytes = 0;
+#ifndef NBODY_MMAP
+	std::vector<unsigned char, AlignedAllocator<unsigned char>> buffer; //! The whole file, where there's no mmap
+#endif
+
+public:
+	MappedSnapshot() = default;
+	MappedSnapshot(const MappedSnapshot&) = delete;
+	MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+	~MappedSnapshot()
+	{
+		close();
+	}
+
+	// Map path and check its header. Returns false, with the reason on err, if it isn't a
+	// snapshot this build can read.
+	bool open(const char* path, std::ostream& err)
+	{
+		close();
+		if (!map(path))
+		{
+			err << "Can't read snapshot " << path << "\n";
+			return false;
+		}
+
+		const char* problem = validate();
+		if (problem != nullptr)
+		{
+			err << "Snapshot " << path << " " << problem << "\n";
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#ifdef NBODY_MMAP
+		if (data != nullptr)
+		{
+			munmap(const_cast<unsigned char*>(data), bytes);
+		}
+#else
+		buffer.clear();
+		buffer.shrink_to_fit();
+#endif
+		data = nullptr;
+		bytes = 0;
+	}
+
+	bool isOpen() const
+	{
+		return data != nullptr;
+	}
+
+	const SnapshotHeader& header() const
+	{
+		return *reinterpret_cast<const SnapshotHeader*>(data);
+	}
+
+	size_t size() const
+	{
+		return size_t(header().count);
+	}
+
+	SnapshotLayout layout() const
+	{
+		return SnapshotLayout(header().layout);
+	}
+
+	bool hasVelocities() const
+	{
+		return (header().flags & SNAPSHOT_VELOCITIES) != 0;
+	}
+
+	// Packed layout only: the arrays in place, velocities null without them
+	const Vec4* positions() const
+	{
+		return reinterpret_cast<const Vec4*>(data + header().positions);
+	}
+
+	const Vec4* velocities() const
+	{
+		return hasVelocities() ? reinterpret_cast<const Vec4*>(data + header().velocities) : nullptr;
+	}
+
+	// SoA layout only: stream c of the array, x, y, z then w
+	const double* positionStream(unsigned c) const
+	{
+		return reinterpret_cast<const double*>(data + header().positions + c * SnapshotStreamStride(header().count));
+	}
+
+	const double* velocityStream(unsigned c) const
+	{
+		return hasVelocities()
+			? reinterpret_cast<const double*>(data + header().velocities + c * SnapshotStreamStride(header().count)) : nullptr;
+	}
+
+	// The first n bodies of either layout as points, n clamped to the snapshot. Velocities
+	// come back at rest if the snapshot has none.
+	std::vector<Vec4> getPositions(size_t n = SIZE_MAX) const
+	{
+		return gather(header().positions, std::min(n, size()));
+	}
+
+	std::vector<Vec4> getVelocities(size_t n = SIZE_MAX) const
+	{
+		n = std::min(n, size());
+		return hasVelocities() ? gather(header().velocities, n) : std::vector<Vec4>(n, Vec4(0.0, 0.0, 0.0, 0.0));
+	}
+
+private:
+	std::vector<Vec4> gather(uint64_t offset, size_t n) const
+	{
+		if (layout() == SnapshotLayout::Packed)
+		{
+			const Vec4* array = reinterpret_cast<const Vec4*>(data + offset);
+			return std::vector<Vec4>(array, array + n);
+		}
+
+		std::vector<Vec4> res(n);
+		const uint64_t stride = SnapshotStreamStride(header().count);
+		for (unsigned c = 0; c < 4; c++)
+		{
+			const double* stream = reinterpret_cast<const double*>(data + offset + c * stride);
+			for (size_t i = 0; i < n; i++)
+			{
+				res[i][c] = stream[i];
+			}
+		}
+		return res;
+	}
+
+	bool map(const char* path)
+	{
+#ifdef NBODY_MMAP
+		const int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+		{
+			return false;
+		}
+		struct stat info;
+		void* mapping = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			bytes = size_t(info.st_size);
+			mapping = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		::close(fd);
+		if (mapping == MAP_FAILED)
+		{
+			bytes = 0;
+			return false;
+		}
+		data = static_cast<const unsigned char*>(mapping);
+#else
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+		{
+			return false;
+		}
+		buffer.resize(size_t(file.tellg()));
+		file.seekg(0);
+		if (buffer.empty() || !file.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(buffer.size())))
+		{
+			buffer.clear();
+			return false;
+		}
+		data = buffer.data();
+		bytes = buffer.size();
+#endif
+		return true;
+	}
+
+	// Reason the mapped file can't be used, null if it can
+	const char* validate() const
+	{
+		if (bytes < sizeof(SnapshotHeader))
+		{
+			return "is too short for a header";
+		}
+		const SnapshotHeader& h = header();
+		if (std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0)
+		{
+			return "is not a snapshot";
+		}
+		if (h.byte_order != SNAPSHOT_BYTE_ORDER)
+		{
+			return "was written with the other byte order";
+		}
+		if (h.version != SNAPSHOT_VERSION)
+		{
+			return "has an unsupported version";
+		}
+		if (h.layout != uint32_t(SnapshotLayout::Packed) && h.layout != uint32_t(SnapshotLayout::Soa))
+		{
+			return "has an unknown layout";
+		}
+
+		const uint64_t array = SnapshotArrayBytes(layout(), h.count);
+		auto fits = [&](uint64_t offset)
+		{
+			return offset % SNAPSHOT_ALIGN == 0 && offset >= sizeof(SnapshotHeader) && offset <= bytes && array <= bytes - offset;
+		};
+		if (h.count > bytes / sizeof(double) || !fits(h.positions) || (hasVelocities() && !fits(h.velocities)))
+		{
+			return "is truncated";
+		}
+		return nullptr;
+	}
+};
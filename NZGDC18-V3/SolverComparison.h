@@ -0,0 +1,145 @@
+#pragma once
+
+#include "Accuracy.h"
+#include "Bodies.h"
+#include "Fmm.h"
+#include "ForceKernels.h"
+#include "ForcePass.h"
+#include "LinearOctree.h"
+#include "OpeningCriteria.h"
+#include "ThreadPool.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+/*
+	Barnes-Hut against the fast multipole solver at equal accuracy.
+
+	Both solvers trade accuracy for speed through their opening angle, so comparing them
+	at the same theta says little. Instead each is swept over SOLVER_THETAS and measured
+	against a direct sum on a sample of the bodies; the cheapest run of each that stays
+	under a target error is what a caller would actually pick. Barnes-Hut runs with the
+	Barnes-Hut criterion and quadrupoles, the FMM translates quadrupoles too, and both
+	times include building the tree.
+*/
+const constexpr double SOLVER_THETAS[] = { 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9 };
+const constexpr double SOLVER_TARGET_ERRORS[] = { 1e-2, 1e-3, 1e-4 };
+
+struct SolverRun {
+	const char* solver;
+	double theta;
+	double seconds;
+	double error;        //! Mean relative acceleration error over the sampled bodies
+	size_t interactions; //! Body-body and cell-body or cell-cell terms evaluated
+};
+
+// Mean relative error of accelerations against reference, taken at every stride'th body
+inline double SampleError(const std::vector<Vec4>& accelerations, const std::vector<Vec4>& reference, size_t stride)
+{
+	double sum = 0.0;
+	for (size_t k = 0; k < reference.size(); k++)
+	{
+		const Vec4 d = accelerations[k * stride] - reference[k];
+		const double norm_sqr = reference[k].normSquared();
+		if (norm_sqr > 0.0)
+		{
+			sum += std::sqrt(d.normSquared() / norm_sqr);
+		}
+	}
+	return reference.empty() ? 0.0 : sum / double(reference.size());
+}
+
+inline std::vector<SolverRun> CompareSolvers(const std::vector<Vec4>& points, ThreadPool& pool, ForceKernel kernel, double G,
+	size_t samples = 1000)
+{
+	std::vector<SolverRun> res;
+	const size_t n = points.size();
+	if (n == 0)
+	{
+		return res;
+	}
+
+	// Direct sum on every stride'th body, in double precision with the scalar kernel
+	const size_t stride = std::max<size_t>(1, n / std::max<size_t>(1, samples));
+	std::vector<uint32_t> sampled;
+	for (size_t i = 0; i < n; i += stride)
+	{
+		sampled.push_back(uint32_t(i));
+	}
+	std::vector<Vec4> reference;
+	DirectAccelerations(Bodies::fromPoints(points), points, sampled, G, ForceBatchScalar, pool, reference);
+
+	LinearOctree tree;
+	tree.setQuadrupoles(true);
+	ForcePass<LinearOctree> pass;
+	pass.setQuadrupoles(true);
+	FmmSolver fmm;
+	std::vector<Vec4> accelerations(n, Vec4(0.0, 0.0, 0.0, 0.0));
+
+	for (double theta : SOLVER_THETAS)
+	{
+		auto p1 = std::chrono::steady_clock::now();
+		tree.buildParallel(points, pool);
+		const size_t interactions = pass.run(tree, n, BarnesHutCriterion(theta), G, kernel, pool,
+			[&](size_t i) { const Vec4& p = points[i]; return Vec4(p.x, p.y, p.z, 1.0); },
+			[&](size_t i, const Vec4& a) { accelerations[i] = a; });
+		auto p2 = std::chrono::steady_clock::now();
+		res.push_back({ "Barnes-Hut", theta, std::chrono::duration_cast<std::chrono::duration<double>>(p2 - p1).count(),
+			SampleError(accelerations, reference, stride), interactions });
+	}
+
+	for (double theta : SOLVER_THETAS)
+	{
+		fmm.setTheta(theta);
+		auto p1 = std::chrono::steady_clock::now();
+		tree.buildParallel(points, pool);
+		const size_t interactions = fmm.run(tree, G, kernel, pool, accelerations);
+		auto p2 = std::chrono::steady_clock::now();
+		res.push_back({ "FMM", theta, std::chrono::duration_cast<std::chrono::duration<double>>(p2 - p1).count(),
+			SampleError(accelerations, reference, stride), interactions });
+	}
+
+	return res;
+}
+
+// Print every run, then the fastest run of each solver under each target error
+inline void PrintSolverComparison(const std::vector<SolverRun>& runs, size_t bodies, std::ostream& out)
+{
+	for (const auto& r : runs)
+	{
+		out << r.solver << " theta " << r.theta << ": " << r.seconds * 1000.0 << " ms, error " << r.error << ", "
+			<< double(r.interactions) / double(bodies) << " interactions per body" << std::endl;
+	}
+
+	for (double target : SOLVER_TARGET_ERRORS)
+	{
+		out << "Fastest under " << target << " error:";
+		for (const char* solver : { "Barnes-Hut", "FMM" })
+		{
+			const SolverRun* best = nullptr;
+			for (const auto& r : runs)
+			{
+				if (std::strcmp(r.solver, solver) == 0 && r.error < target && (best == nullptr || r.seconds < best->seconds))
+				{
+					best = &r;
+				}
+			}
+
+			out << " " << solver;
+			if (best != nullptr)
+			{
+				out << " " << best->seconds * 1000.0 << " ms (theta " << best->theta << ")";
+			}
+			else
+			{
+				out << " none";
+			}
+		}
+		out << std::endl;
+	}
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+	Work-stealing thread pool.
+
+	Each worker owns a deque of index ranges. A worker pops ranges from the back of
+	its own deque and, once that runs dry, steals from the front of the other workers'
+	deques. The calling thread participates as worker 0, so a pool of N threads spawns
+	N - 1 background threads.
+*/
+class ThreadPool {
+	struct Range {
+		size_t begin;
+		size_t end;
+	};
+
+	// Pad each queue to its own cache line so owners and thieves don't false share
+	struct alignas(64) WorkQueue {
+		std::mutex lock;
+		std::deque<Range> ranges;
+	};
+
+	using Job = std::function<void(size_t, size_t, size_t)>;
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex job_lock;
+	std::condition_variable job_signal;
+	std::condition_variable done_signal;
+	const Job* job;
+	size_t generation;
+	bool stopping;
+	std::atomic<size_t> pending;
+
+public:
+	// A thread count of 0 uses every hardware thread
+	explicit ThreadPool(size_t threads = 0)
+		: job(nullptr)
+		, generation(0)
+		, stopping(false)
+		, pending(0)
+	{
+		if (threads == 0)
+		{
+			threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+		}
+
+		for (size_t i = 0; i < threads; ++i)
+		{
+			queues.emplace_back(new WorkQueue());
+		}
+
+		for (size_t i = 1; i < threads; ++i)
+		{
+			workers.emplace_back([this, i] { workerLoop(i); });
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> l(job_lock);
+			stopping = true;
+		}
+		job_signal.notify_all();
+
+		for (auto& t : workers)
+		{
+			t.join();
+		}
+	}
+
+	size_t size() const
+	{
+		return queues.size();
+	}
+
+	// Invoke f(begin, end, worker) over [begin, end) split into chunks of at most grain indices.
+	// Blocks until every chunk has run. The worker index is stable for the duration of a chunk,
+	// so callers can use it to select per-worker scratch state.
+	template<typename F>
+	void parallelFor(size_t begin, size_t end, size_t grain, F f)
+	{
+		if (begin >= end)
+		{
+			return;
+		}
+
+		grain = std::max<size_t>(1, grain);
+		const size_t chunks = (end - begin + grain - 1) / grain;
+
+		if (queues.size() == 1 || chunks == 1)
+		{
+			for (size_t lo = begin; lo < end; lo += grain)
+			{
+				f(lo, std::min(end, lo + grain), 0);
+			}
+			return;
+		}
+
+		const Job fn = f;
+
+		{
+			std::lock_guard<std::mutex> l(job_lock);
+			job = &fn;
+			pending.store(chunks, std::memory_order_relaxed);
+
+			// Deal contiguous runs of chunks to each worker, stealing evens out the rest
+			const size_t per_worker = (chunks + queues.size() - 1) / queues.size();
+			size_t chunk = 0;
+			for (size_t lo = begin; lo < end; lo += grain, ++chunk)
+			{
+				WorkQueue& q = *queues[chunk / per_worker];
+				std::lock_guard<std::mutex> ql(q.lock);
+				q.ranges.push_back(Range{ lo, std::min(end, lo + grain) });
+			}
+
+			generation++;
+		}
+		job_signal.notify_all();
+
+		drain(0);
+
+		std::unique_lock<std::mutex> l(job_lock);
+		done_signal.wait(l, [this] { return pending.load(std::memory_order_acquire) == 0; });
+		job = nullptr;
+	}
+
+private:
+	bool popLocal(size_t worker, Range& r)
+	{
+		WorkQueue& q = *queues[worker];
+		std::lock_guard<std::mutex> l(q.lock);
+		if (q.ranges.empty())
+		{
+			return false;
+		}
+		r = q.ranges.back();
+		q.ranges.pop_back();
+		return true;
+	}
+
+	bool steal(size_t worker, Range& r)
+	{
+		for (size_t i = 1; i < queues.size(); ++i)
+		{
+			WorkQueue& q = *queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> l(q.lock);
+			if (!q.ranges.empty())
+			{
+				r = q.ranges.front();
+				q.ranges.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void drain(size_t worker)
+	{
+		Range r;
+		while (popLocal(worker, r) || steal(worker, r))
+		{
+			// The job was published before the range was queued, and we took the queue
+			// lock to get here, so reading it is safe
+			(*job)(r.begin, r.end, worker);
+
+			if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				std::lock_guard<std::mutex> l(job_lock);
+				done_signal.notify_all();
+			}
+		}
+	}
+
+	void workerLoop(size_t worker)
+	{
+		size_t seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> l(job_lock);
+				job_signal.wait(l, [&] { return stopping || generation != seen; });
+				if (stopping)
+				{
+					return;
+				}
+				seen = generation;
+			}
+
+			drain(worker);
+		}
+	}
+};
+
+/*
+	In place exclusive prefix sum over values, returning the total. Blocks are summed
+	concurrently, the block totals are scanned serially and then added back concurrently.
+*/
+template<typename T>
+T ParallelExclusiveScan(ThreadPool& pool, std::vector<T>& values)
+{
+	const size_t n = values.size();
+	const size_t blocks = std::max<size_t>(1, std::min(pool.size(), n / 4096));
+	const size_t block_size = std::max<size_t>(1, (n + blocks - 1) / blocks);
+	std::vector<T> totals(blocks, T(0));
+
+	pool.parallelFor(0, n, block_size, [&](size_t begin, size_t end, size_t)
+	{
+		T acc = T(0);
+		for (size_t i = begin; i < end; i++)
+		{
+			const T v = values[i];
+			values[i] = acc;
+			acc += v;
+		}
+		totals[begin / block_size] = acc;
+	});
+
+	T acc = T(0);
+	for (auto& t : totals)
+	{
+		const T v = t;
+		t = acc;
+		acc += v;
+	}
+
+	pool.parallelFor(0, n, block_size, [&](size_t begin, size_t end, size_t)
+	{
+		const T base = totals[begin / block_size];
+		for (size_t i = begin; i < end; i++)
+		{
+			values[i] += base;
+		}
+	});
+
+	return acc;
+}
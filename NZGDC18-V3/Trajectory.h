@@ -0,0 +1,447 @@
+#pragma once
+
+#include "Bodies.h"
+#include "FrameCodec.h"
+#include "Vec4.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+/*
+	Trajectory files and the asynchronous writer.
+
+	A trajectory is a TrajectoryHeader and a run of frames, each a TrajectoryFrameHeader
+	and its payload in the file's FrameCodec. The header and every frame are padded to
+	TRAJECTORY_ALIGN, so each frame goes out as a single large write of whole pages from
+	an aligned buffer, and a reader can map the file and find every frame on a page.
+
+	TrajectoryWriter keeps two frame buffers. submit() copies the bodies into a free one
+	and hands it to a background thread, which encodes and writes it while the simulation
+	carries on. The simulation thread never waits for the disk: if the writer still holds
+	both buffers the frame is dropped and counted instead. What submit() does cost, the
+	copy and a lock hand-off, is timed, so the jitter writing adds to a frame is measured
+	rather than assumed.
+*/
+const constexpr char TRAJECTORY_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+const constexpr uint32_t TRAJECTORY_VERSION = 2; //! 2 adds the Morton layout for Quantised keyframes
+const constexpr uint32_t TRAJECTORY_BYTE_ORDER = 0x01020304; //! Reads back swapped on a foreign machine
+const constexpr size_t TRAJECTORY_ALIGN = 4096;
+const constexpr uint32_t TRAJECTORY_KEYFRAME = 1;           //! Frame flag: decodes without the frame before it
+
+struct TrajectoryHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t codec;             //! FrameCodec
+	uint32_t keyframe_interval; //! Frames from one keyframe to the next
+	uint64_t count;             //! Bodies in every frame
+	uint8_t reserved[32];
+};
+
+struct TrajectoryFrameHeader {
+	uint64_t step;
+	double time;
+	uint64_t bytes;    //! Payload bytes, before padding
+	uint32_t flags;
+	uint32_t reserved0;
+	uint8_t reserved[32];
+};
+
+static_assert(sizeof(TrajectoryHeader) == 64, "Trajectory headers are one cache line");
+static_assert(sizeof(TrajectoryFrameHeader) == 64, "Frame headers are one cache line");
+
+inline size_t TrajectoryAlignUp(size_t bytes)
+{
+	return (bytes + TRAJECTORY_ALIGN - 1) / TRAJECTORY_ALIGN * TRAJECTORY_ALIGN;
+}
+
+struct TrajectoryStats {
+	size_t frames = 0;         //! Frames written
+	size_t dropped = 0;        //! Frames submitted while both buffers were busy
+	size_t raw_bytes = 0;      //! Bytes of the written frames as Vec4 arrays
+	size_t file_bytes = 0;     //! Bytes written, headers and padding included
+	double encode = 0.0;       //! Seconds the writer spent encoding
+	double write = 0.0;        //! Seconds the writer spent writing
+	double submit = 0.0;       //! Seconds the simulation spent in submit()
+	double max_submit = 0.0;   //! Longest single submit(), the added frame time jitter
+	double max_error = 0.0;    //! Largest position error a Quantised frame allowed, 0 when lossless
+};
+
+inline void PrintTrajectoryStats(const TrajectoryStats& s, std::ostream& out)
+{
+	const size_t submitted = s.frames + s.dropped;
+	out << "Trajectory: " << s.frames << " frames written, " << s.dropped << " dropped, "
+		<< double(s.raw_bytes) / double(std::max<size_t>(s.file_bytes, 1)) << "x compression, "
+		<< s.encode * 1000.0 / double(std::max<size_t>(s.frames, 1)) << " ms encoding and "
+		<< s.write * 1000.0 / double(std::max<size_t>(s.frames, 1)) << " ms writing per frame; submit took "
+		<< s.submit * 1000.0 / double(std::max<size_t>(submitted, 1)) << " ms on average, " << s.max_submit * 1000.0
+		<< " ms at most." << std::endl;
+	if (s.max_error > 0.0)
+	{
+		out << "Trajectory positions within " << s.max_error << " of the simulation's." << std::endl;
+	}
+}
+
+class TrajectoryWriter {
+	enum class Slot {
+		Free,    //! Owned by the simulation thread
+		Ready,   //! Waiting for the writer
+		Writing, //! Owned by the writer thread
+	};
+
+	struct Frame {
+		std::vector<Vec4> bodies;
+		uint64_t step = 0;
+		double time = 0.0;
+		uint64_t sequence = 0;
+		Slot slot = Slot::Free;
+	};
+
+	using Clock = std::chrono::steady_clock;
+
+	std::FILE* file = nullptr;
+	FrameEncoder encoder;
+	uint32_t keyframe_interval;
+	size_t count = 0;
+
+	Frame frames[2];
+	std::vector<unsigned char, AlignedAllocator<unsigned char, TRAJECTORY_ALIGN>> staging;
+	uint64_t submitted = 0;
+	uint64_t encoded = 0;
+	bool failed = false;
+
+	mutable std::mutex lock;
+	std::condition_variable ready;
+	std::condition_variable idle;
+	bool stopping = false;
+	TrajectoryStats stats;
+	std::thread worker;
+
+public:
+	static const constexpr uint32_t KEYFRAME_INTERVAL = 64; //! Default frames between keyframes
+
+	// max_error bounds the error of a Quantised trajectory, see FrameCodec.h
+	TrajectoryWriter(FrameCodec codec = FrameCodec::XorDelta, uint32_t keyframe_interval = KEYFRAME_INTERVAL,
+		double max_error = QUANTISED_ERROR)
+		: encoder(codec, max_error)
+		, keyframe_interval(std::max<uint32_t>(keyframe_interval, 1))
+	{
+	}
+
+	TrajectoryWriter(const TrajectoryWriter&) = delete;
+	TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+	~TrajectoryWriter()
+	{
+		close();
+	}
+
+	// Create path for frames of count bodies and start the writer thread. Returns false,
+	// with the reason on err, if the file can't be created.
+	bool open(const char* path, size_t bodies, std::ostream& err)
+	{
+		close();
+		file = std::fopen(path, "wb");
+		if (file == nullptr)
+		{
+			err << "Can't create trajectory " << path << "\n";
+			return false;
+		}
+
+		// Every write is a whole frame from the aligned staging buffer, so stdio's own
+		// buffering would only add a copy
+		std::setvbuf(file, nullptr, _IONBF, 0);
+
+		count = bodies;
+		staging.assign(TrajectoryAlignUp(sizeof(TrajectoryFrameHeader) + FrameCodecBound(encoder.getCodec(), count)), 0);
+		TrajectoryHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+		header.version = TRAJECTORY_VERSION;
+		header.byte_order = TRAJECTORY_BYTE_ORDER;
+		header.codec = uint32_t(encoder.getCodec());
+		header.keyframe_interval = keyframe_interval;
+		header.count = count;
+		std::memcpy(staging.data(), &header, sizeof(header));
+		if (std::fwrite(staging.data(), 1, TRAJECTORY_ALIGN, file) != TRAJECTORY_ALIGN)
+		{
+			err << "Failed writing trajectory " << path << "\n";
+			std::fclose(file);
+			file = nullptr;
+			return false;
+		}
+
+		for (auto& frame : frames)
+		{
+			frame.bodies.resize(count);
+			frame.slot = Slot::Free;
+		}
+		submitted = 0;
+		encoded = 0;
+		failed = false;
+		stopping = false;
+		stats = TrajectoryStats();
+		stats.file_bytes = TRAJECTORY_ALIGN;
+		worker = std::thread([this]() { run(); });
+		return true;
+	}
+
+	// Write every frame still pending and close the file. Returns false if any write failed.
+	bool close()
+	{
+		if (file == nullptr)
+		{
+			return true;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		ready.notify_one();
+		worker.join();
+
+		const bool ok = std::fclose(file) == 0 && !failed;
+		file = nullptr;
+		return ok;
+	}
+
+	bool isOpen() const
+	{
+		return file != nullptr;
+	}
+
+	// Hand bodies, count of them, to the writer as the frame for step. Never waits for
+	// the disk: returns false, dropping the frame, if both buffers are still in use.
+	bool submit(uint64_t step, double time, const Vec4* bodies)
+	{
+		const auto start = Clock::now();
+		Frame* frame = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (auto& f : frames)
+			{
+				if (f.slot == Slot::Free)
+				{
+					frame = &f;
+					break;
+				}
+			}
+			if (frame == nullptr)
+			{
+				stats.dropped++;
+				record(start);
+				return false;
+			}
+		}
+
+		// A free buffer belongs to this thread until it's marked ready
+		std::memcpy(frame->bodies.data(), bodies, count * sizeof(Vec4));
+		frame->step = step;
+		frame->time = time;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			frame->sequence = submitted++;
+			frame->slot = Slot::Ready;
+			record(start);
+		}
+		ready.notify_one();
+		return true;
+	}
+
+	// Block until every submitted frame is written
+	void flush()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		idle.wait(guard, [this]() { return encoded == submitted; });
+	}
+
+	TrajectoryStats getStats() const
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return stats;
+	}
+
+private:
+	// Called under the lock
+	void record(Clock::time_point start)
+	{
+		const double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - start).count();
+		stats.submit += seconds;
+		stats.max_submit = std::max(stats.max_submit, seconds);
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;)
+		{
+			// Oldest ready frame first, so frames land in step order
+			Frame* frame = nullptr;
+			for (auto& f : frames)
+			{
+				if (f.slot == Slot::Ready && (frame == nullptr || f.sequence < frame->sequence))
+				{
+					frame = &f;
+				}
+			}
+			if (frame == nullptr)
+			{
+				if (stopping)
+				{
+					return;
+				}
+				ready.wait(guard);
+				continue;
+			}
+
+			frame->slot = Slot::Writing;
+			bool keyframe = encoded % keyframe_interval == 0;
+			guard.unlock();
+
+			const auto p1 = Clock::now();
+			TrajectoryFrameHeader header;
+			std::memset(&header, 0, sizeof(header));
+			header.step = frame->step;
+			header.time = frame->time;
+			header.bytes = encoder.encode(frame->bodies.data(), count, keyframe, staging.data() + sizeof(header));
+			header.flags = keyframe ? TRAJECTORY_KEYFRAME : 0;
+			std::memcpy(staging.data(), &header, sizeof(header));
+
+			// Zero the padding so files are reproducible
+			const size_t used = sizeof(header) + size_t(header.bytes);
+			const size_t padded = TrajectoryAlignUp(used);
+			std::memset(staging.data() + used, 0, padded - used);
+
+			const auto p2 = Clock::now();
+			const bool ok = std::fwrite(staging.data(), 1, padded, file) == padded;
+			const auto p3 = Clock::now();
+
+			guard.lock();
+			frame->slot = Slot::Free;
+			encoded++;
+			failed = failed || !ok;
+			stats.frames++;
+			stats.raw_bytes += count * sizeof(Vec4);
+			stats.file_bytes += padded;
+			stats.encode += std::chrono::duration_cast<std::chrono::duration<double>>(p2 - p1).count();
+			stats.write += std::chrono::duration_cast<std::chrono::duration<double>>(p3 - p2).count();
+			if (encoder.getCodec() == FrameCodec::Quantised)
+			{
+				stats.max_error = std::max(stats.max_error, encoder.getMaxError());
+			}
+			idle.notify_all();
+		}
+	}
+};
+
+// Sequential reader for trajectory files, decoding each frame in turn
+class TrajectoryReader {
+	std::FILE* file = nullptr;
+	TrajectoryHeader header;
+	FrameDecoder decoder;
+	std::vector<unsigned char> payload;
+
+public:
+	TrajectoryReader() = default;
+	TrajectoryReader(const TrajectoryReader&) = delete;
+	TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+	~TrajectoryReader()
+	{
+		if (file != nullptr)
+		{
+			std::fclose(file);
+		}
+	}
+
+	// Returns false, with the reason on err, if path isn't a trajectory this build can read
+	bool open(const char* path, std::ostream& err)
+	{
+		file = std::fopen(path, "rb");
+		if (file == nullptr || std::fread(&header, sizeof(header), 1, file) != 1)
+		{
+			err << "Can't read trajectory " << path << "\n";
+			return false;
+		}
+		if (std::memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0 || header.version != TRAJECTORY_VERSION
+			|| header.byte_order != TRAJECTORY_BYTE_ORDER || header.codec > uint32_t(FrameCodec::Quantised))
+		{
+			err << "Trajectory " << path << " has an unsupported header\n";
+			return false;
+		}
+		decoder = FrameDecoder(FrameCodec(header.codec));
+		return std::fseek(file, long(TRAJECTORY_ALIGN), SEEK_SET) == 0;
+	}
+
+	size_t size() const
+	{
+		return size_t(header.count);
+	}
+
+	// Decode the next frame into bodies. Returns false at the end of the file or on a
+	// damaged frame.
+	bool next(std::vector<Vec4>& bodies, uint64_t& step, double& time)
+	{
+		TrajectoryFrameHeader frame;
+		if (std::fread(&frame, sizeof(frame), 1, file) != 1 || frame.bytes > FrameCodecBound(FrameCodec(header.codec), size()))
+		{
+			return false;
+		}
+
+		const size_t padded = TrajectoryAlignUp(sizeof(frame) + size_t(frame.bytes)) - sizeof(frame);
+		payload.resize(padded + FRAME_CODEC_SLACK);
+		if (std::fread(payload.data(), 1, padded, file) != padded)
+		{
+			return false;
+		}
+
+		bodies.resize(size());
+		step = frame.step;
+		time = frame.time;
+		return decoder.decode(payload.data(), size_t(frame.bytes), size(), (frame.flags & TRAJECTORY_KEYFRAME) != 0, bodies.data());
+	}
+};
+
+// Read path back and compare it with frames, the bodies of each frame written to it in
+// order, stepped as steps says. Returns false, with the reason on err, if a frame is
+// missing, out of step or fails to decode, and the largest difference in any coordinate
+// or mass in max_error otherwise: 0 for the lossless codecs.
+inline bool VerifyTrajectory(const char* path, const std::vector<std::vector<Vec4>>& frames,
+	const std::vector<uint64_t>& steps, double& max_error, std::ostream& err)
+{
+	TrajectoryReader reader;
+	if (!reader.open(path, err))
+	{
+		return false;
+	}
+
+	max_error = 0.0;
+	std::vector<Vec4> decoded;
+	for (size_t f = 0; f < frames.size(); f++)
+	{
+		uint64_t step;
+		double time;
+		if (!reader.next(decoded, step, time) || step != steps[f] || decoded.size() != frames[f].size())
+		{
+			err << "Trajectory " << path << " doesn't read back at frame " << f << "\n";
+			return false;
+		}
+		for (size_t i = 0; i < decoded.size(); i++)
+		{
+			for (unsigned a = 0; a < 4; a++)
+			{
+				max_error = std::max(max_error, std::abs(decoded[i][a] - frames[f][i][a]));
+			}
+		}
+	}
+	return true;
+}
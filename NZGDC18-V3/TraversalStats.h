@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/*
+	Tree walk statistics.
+
+	Every walk runs on a caller owned TraversalStack, one per worker, and the stack counts
+	as it goes: nodes popped, cells accepted in place of their bodies, bodies interacted
+	with one by one and the deepest the stack grew. Each stack is padded to its own cache
+	line, so the counts are plain increments with nothing shared between workers, and are
+	merged once the pass is done. They are always on: the increments sit beside a pop and
+	a push the walk makes anyway.
+*/
+struct TraversalStats {
+	uint64_t walks = 0;             //! Walks started, one per target or group
+	uint64_t nodes_visited = 0;     //! Nodes popped off the stack
+	uint64_t clusters_accepted = 0; //! Cells standing in for their bodies
+	uint64_t leaf_interactions = 0; //! Bodies interacted with one by one
+	uint64_t max_stack_depth = 0;
+
+	uint64_t interactions() const
+	{
+		return clusters_accepted + leaf_interactions;
+	}
+
+	void merge(const TraversalStats& other)
+	{
+		walks += other.walks;
+		nodes_visited += other.nodes_visited;
+		clusters_accepted += other.clusters_accepted;
+		leaf_interactions += other.leaf_interactions;
+		max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+	}
+};
+
+// Pad each stack to its own cache line so workers counting side by side don't false share
+template <typename T>
+class alignas(64) TraversalStack {
+	std::vector<T> items;
+
+public:
+	TraversalStats stats;
+
+	// Start a walk from root
+	void begin(const T& root)
+	{
+		items.clear();
+		stats.walks++;
+		push(root);
+	}
+
+	bool empty() const
+	{
+		return items.empty();
+	}
+
+	void push(const T& node)
+	{
+		items.push_back(node);
+		stats.max_stack_depth = std::max<uint64_t>(stats.max_stack_depth, items.size());
+	}
+
+	T pop()
+	{
+		const T node = items.back();
+		items.pop_back();
+		stats.nodes_visited++;
+		return node;
+	}
+
+	void accepted()
+	{
+		stats.clusters_accepted++;
+	}
+
+	void interacted()
+	{
+		stats.leaf_interactions++;
+	}
+};
+
+const constexpr size_t TREE_DEPTH_BINS = 32; //! The last bin also holds every deeper leaf
+
+// Leaves of a tree by depth, the root at 0
+struct DepthHistogram {
+	uint64_t counts[TREE_DEPTH_BINS] = {};
+
+	void add(size_t depth)
+	{
+		counts[std::min(depth, TREE_DEPTH_BINS - 1)]++;
+	}
+
+	void merge(const DepthHistogram& other)
+	{
+		for (size_t i = 0; i < TREE_DEPTH_BINS; i++)
+		{
+			counts[i] += other.counts[i];
+		}
+	}
+
+	// Deepest bin holding any leaf
+	size_t maxDepth() const
+	{
+		size_t res = 0;
+		for (size_t i = 0; i < TREE_DEPTH_BINS; i++)
+		{
+			if (counts[i] != 0)
+			{
+				res = i;
+			}
+		}
+		return res;
+	}
+};
+
+/*
+	Everything a frame's force pass can say about the scene: the merged walk counts, the
+	interactions the kernels evaluated (more than the walks found when groups share a walk)
+	and the tree's leaf depths. Frames add up for totals over a run.
+*/
+struct InteractionStats {
+	TraversalStats traversal;
+	uint64_t evaluated = 0; //! Interactions through the force kernels
+	DepthHistogram leaf_depths;
+
+	void merge(const InteractionStats& other)
+	{
+		traversal.merge(other.traversal);
+		evaluated += other.evaluated;
+		leaf_depths.merge(other.leaf_depths);
+	}
+};
+
+inline void PrintInteractionStats(const InteractionStats& s, std::ostream& out)
+{
+	const TraversalStats& t = s.traversal;
+	const double walks = double(std::max<uint64_t>(t.walks, 1));
+	out << "Tree walks: " << t.walks << ", " << double(t.nodes_visited) / walks << " nodes visited, "
+		<< double(t.clusters_accepted) / walks << " clusters accepted and " << double(t.leaf_interactions) / walks
+		<< " leaf interactions per walk, stack depth at most " << t.max_stack_depth << "." << std::endl;
+	out << "Interactions evaluated: " << s.evaluated << std::endl;
+
+	out << "Leaf depths:";
+	for (size_t i = 0, n = s.leaf_depths.maxDepth(); i <= n; i++)
+	{
+		out << " " << s.leaf_depths.counts[i];
+	}
+	out << std::endl;
+}